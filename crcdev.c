@@ -10,6 +10,29 @@
 #include <linux/interrupt.h>
 #include <linux/pci.h>
 #include <linux/semaphore.h>
+#include <linux/topology.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/bitops.h>
+#include <linux/idr.h>
+#include <linux/rcupdate.h>
+#include <linux/seqlock.h>
+#include <linux/scatterlist.h>
+#include <linux/dma-mapping.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/async.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/debugfs.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/cgroup.h>
+#include <linux/seq_file.h>
+#include <crypto/internal/hash.h>
+#include <asm/unaligned.h>
 #include <asm/spinlock.h>
 #include <asm/uaccess.h>
 #include <asm/io.h>
@@ -25,17 +48,80 @@ spinlock_t driver_lock = SPIN_LOCK_UNLOCKED;
 struct class *crcdev_class;
 /* Major number of crc devices. */
 int crcdev_major = 0;
-/* Indicates whether minor number is free. */
-unsigned char minor_status[MAX_DEVICES];
 /* There are some problems with reusing minors, so each minor is used at most
  once. */
 int first_unused_minor = 0;
-/* Contains structs for each device. */
-struct crc_device *crc_devices[MAX_DEVICES];
-/* Inidcates if i-th device is working or is about to be removed. */
-unsigned char device_status[MAX_DEVICES];
+/* Maps minors to devices. Modified under driver_lock, open looks devices up
+ under RCU. */
+struct idr crc_devices;
+/* Cache for files' private data. */
+struct kmem_cache *crcdev_file_cache;
+/* Cache and workqueue for asynchronous requests. */
+struct kmem_cache *crcdev_job_cache;
+struct workqueue_struct *crcdev_wq;
 /* Indicates if driver is working or is about to be removed. */
 unsigned char driver_status;
+/* DMA buffers of a device without open files are freed after this time. */
+unsigned int idle_timeout = 10000;
+module_param(idle_timeout, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(idle_timeout, "Free DMA buffers of devices without open "
+        "files after this many milliseconds (0 - never).");
+/* Crypto API requests shorter than this are not worth a DMA transfer. */
+unsigned int crypto_min_size = 4096;
+module_param(crypto_min_size, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(crypto_min_size, "Crypto API updates shorter than this many "
+        "bytes are computed on the CPU.");
+/* Longest wait for one transfer. A request waiting longer is withdrawn, a
+   request processed by the device for longer means the device stalled. */
+unsigned int request_timeout = 5000;
+module_param(request_timeout, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(request_timeout, "Withdraw transfers not done after this "
+        "many milliseconds and reset a stalled fetch data block (0 - never).");
+/* Finished transfers are completed together: when fetch cmd block goes idle
+   or, while it is busy, every coalesce_usecs. At most coalesce_count
+   transfers are given to the block at once. */
+unsigned int coalesce_usecs = 50;
+module_param(coalesce_usecs, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(coalesce_usecs, "Complete transfers finished while fetch "
+        "cmd block is busy after at most this many microseconds (0 - only "
+        "when it goes idle).");
+unsigned int coalesce_count = CRCDEV_CTX_COUNT;
+module_param(coalesce_count, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(coalesce_count, "Transfers in flight in fetch cmd block "
+        "(1 - one interrupt per transfer).");
+/* Workload recording: opens, writes and ioctls are logged to
+   trace_buf[trace_head..trace_tail) and read from debugfs crcdev/trace. */
+bool trace;
+module_param(trace, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(trace, "Record opens, writes and ioctls in debugfs "
+        "crcdev/trace.");
+spinlock_t trace_lock = SPIN_LOCK_UNLOCKED;
+struct crcdev_trace_rec *trace_buf;
+unsigned int trace_head;
+unsigned int trace_tail;
+/* Records dropped because nobody read them. */
+u32 trace_lost;
+atomic_t trace_files = ATOMIC_INIT(0);
+DECLARE_WAIT_QUEUE_HEAD(trace_wait);
+/* One reader at a time. */
+DEFINE_SEMAPHORE(trace_sem);
+struct dentry *crcdev_debugfs;
+/* Groups of open files and configured groups, protected by
+   crcdev_groups_lock. Files whose group can't be told have the root group,
+   which is always there. */
+LIST_HEAD(crcdev_groups);
+DEFINE_SEMAPHORE(crcdev_groups_lock);
+struct crc_group crcdev_root_group;
+/* Open files, for usage per process (protected by crcdev_files_lock). */
+LIST_HEAD(crcdev_files);
+DEFINE_SEMAPHORE(crcdev_files_lock);
+/* Crypto API algorithms are registered with the first device (flag
+   protected by crcdev_hashes_lock). */
+DEFINE_SEMAPHORE(crcdev_hashes_lock);
+int crcdev_hashes_registered;
+/* Virtual time of the group last given a context. Groups coming back from
+   idle start from it, so that idling doesn't earn device time. */
+atomic64_t crcdev_vclock = ATOMIC64_INIT(0);
 
 static int crcdev_init_module(void);
 static void crcdev_exit_module(void);
@@ -44,11 +130,24 @@ static int crcdev_open(struct inode *inode, struct file *filp);
 static int crcdev_release(struct inode *inode, struct file *filp);
 static ssize_t crcdev_write(struct file *filp, const char __user *buff,
                             size_t count, loff_t *offp);
-static int crcdev_ioctl(struct inode *inode, struct file *filp,
-                        unsigned int cmd, unsigned long arg);
+static long crcdev_ioctl(struct file *filp, unsigned int cmd,
+                         unsigned long arg);
+static unsigned int crcdev_poll(struct file *filp, poll_table *wait);
+#ifdef CONFIG_COMPAT
+static long crcdev_compat_ioctl(struct file *filp, unsigned int cmd,
+                                unsigned long arg);
+#endif
 
 static int crcdev_probe(struct pci_dev *pcidev, const struct pci_device_id *id);
 static void crcdev_remove(struct pci_dev *pcidev);
+static void crcdev_free_fixed_buffers(struct file_priv_data *priv_data);
+static void crcdev_free_streams(struct file_priv_data *priv_data);
+static int crcdev_register_hashes(void);
+static void crcdev_unregister_hashes(void);
+static void crcdev_hash_register(struct work_struct *work);
+static void crcdev_start_requests(struct crc_device *crcdev);
+
+static DECLARE_WORK(crcdev_hash_register_work, crcdev_hash_register);
 
 /* */
 static struct file_operations crcdev_file_ops = {
@@ -56,8 +155,25 @@ static struct file_operations crcdev_file_ops = {
     .open           = crcdev_open,
     .release        = crcdev_release,
     .write          = crcdev_write,
-    .ioctl          = crcdev_ioctl,
+    .unlocked_ioctl = crcdev_ioctl,
+    .poll           = crcdev_poll,
+#ifdef CONFIG_COMPAT
+    .compat_ioctl   = crcdev_compat_ioctl,
+#endif
+};
+
+/* Algorithms provided to the crypto API. Key (initial value) and final xor
+   are the same as in the generic drivers. */
+static const struct {
+    const char *name;
+    u32 poly;
+    u32 key;
+    u32 xor_out;
+} crcdev_hash_params[] = {
+    { "crc32",  0xedb88320, 0,          0 },
+    { "crc32c", 0x82f63b78, 0xffffffff, 0xffffffff },
 };
+static struct ahash_alg crcdev_hash_algs[ARRAY_SIZE(crcdev_hash_params)];
 
 /* */
 static const struct pci_device_id crcdev_id = { 
@@ -72,381 +188,3328 @@ static struct pci_driver crcdev_driver = {
     .remove     = crcdev_remove,
 };
 
-/* Gets first free minor. */
-static int get_free_minor(void)
+/* Idle groups catch up with the others, so that idling doesn't earn
+   device time. */
+static void crcdev_group_catch_up(struct crc_group *group)
 {
-    return first_unused_minor++;
+    s64 vclock = atomic64_read(&crcdev_vclock);
+
+    if (atomic64_read(&group->vtime) < vclock)
+        atomic64_set(&group->vtime, vclock);
 }
 
-/* */
-static int get_free_context(struct crc_device *crcdev)
+/* Moves the virtual clock to a group given a context. */
+static void crcdev_grant_context(struct crc_group *group)
 {
-    int i = 0;
-    for (i = 0; i < CRCDEV_CTX_COUNT; ++i)
-        if (crcdev->ctx_status[i] == CTX_FREE)
-            break;
-    return i;
+    s64 vtime = atomic64_read(&group->vtime);
+
+    if (vtime > atomic64_read(&crcdev_vclock))
+        atomic64_set(&crcdev_vclock, vtime);
 }
 
-/* Interrupt handler. */
-static irqreturn_t crcdev_irq_handler(int irq, void *data)
+/* Takes a free context for a transfer of group. If there is none, waits
+   until put_context hands one over; the group which used the least
+   weighted device time is served first. Returns the context or
+   -ERESTARTSYS. */
+static int get_context(struct crc_device *crcdev, struct crc_group *group,
+                       int interruptible)
 {
-    struct crc_device *crcdev = (struct crc_device *) data;
-    u32 ctl;
+    struct crc_ctx_waiter waiter;
     unsigned long flags;
-    spin_lock_irqsave(&crcdev->regs_lock, flags);
-    ctl = ioread32(crcdev->addr + CRCDEV_INTR);
+    int i;
 
-    if (ctl & CRCDEV_INTR_FETCH_DATA)
+    crcdev_group_catch_up(group);
+    spin_lock_irqsave(&crcdev->regs_lock, flags);
+    if (list_empty(&crcdev->ctx_waiters))
+        for (i = 0; i < CRCDEV_CTX_COUNT; ++i)
+            if (!test_and_set_bit(i, &crcdev->ctx_busy))
+            {
+                crcdev_grant_context(group);
+                spin_unlock_irqrestore(&crcdev->regs_lock, flags);
+                return i;
+            }
+
+    waiter.group = group;
+    waiter.task = current;
+    waiter.granted = NULL;
+    waiter.ctx_no = -1;
+    list_add_tail(&waiter.list, &crcdev->ctx_waiters);
+    for (;;)
     {
-        /* Mark that interrupt was consumed. */
-        iowrite32(1, crcdev->addr + CRCDEV_FETCH_DATA_INTR_ACK);
-        if (crcdev->current_ctx >= 0)
-            complete(&crcdev->fetch_data_event[crcdev->current_ctx]);
+        set_current_state(interruptible ? TASK_INTERRUPTIBLE :
+                TASK_UNINTERRUPTIBLE);
+        if (waiter.ctx_no >= 0)
+            break;
+        if (interruptible && signal_pending(current))
+        {
+            list_del(&waiter.list);
+            break;
+        }
+        spin_unlock_irqrestore(&crcdev->regs_lock, flags);
+        schedule();
+        spin_lock_irqsave(&crcdev->regs_lock, flags);
     }
-    else if (ctl & CRCDEV_INTR_FETCH_CMD_IDLE)
+    __set_current_state(TASK_RUNNING);
+    spin_unlock_irqrestore(&crcdev->regs_lock, flags);
+    return waiter.ctx_no >= 0 ? waiter.ctx_no : -ERESTARTSYS;
+}
+
+/* Takes a free context only if nobody is waiting for one. Returns the
+   context or -1. */
+static int try_get_context(struct crc_device *crcdev, struct crc_group *group)
+{
+    unsigned long flags;
+    int i, ctx_no = -1;
+
+    spin_lock_irqsave(&crcdev->regs_lock, flags);
+    if (list_empty(&crcdev->ctx_waiters))
+        for (i = 0; i < CRCDEV_CTX_COUNT && ctx_no < 0; ++i)
+            if (!test_and_set_bit(i, &crcdev->ctx_busy))
+                ctx_no = i;
+    if (ctx_no >= 0)
+        crcdev_grant_context(group);
+    spin_unlock_irqrestore(&crcdev->regs_lock, flags);
+    return ctx_no;
+}
+
+/* Returns a context: hands it over to the waiter of the group with the
+   least weighted device time (the first one of them), frees it if nobody
+   waits. An asynchronous job given the context only queues its transfer,
+   the caller starts it. Must be called with regs_lock held. */
+static void put_context_locked(struct crc_device *crcdev, int ctx_no)
+{
+    struct crc_ctx_waiter *waiter, *next = NULL;
+
+    list_for_each_entry(waiter, &crcdev->ctx_waiters, list)
+        if (next == NULL || atomic64_read(&waiter->group->vtime) <
+                atomic64_read(&next->group->vtime))
+            next = waiter;
+    if (next == NULL)
     {
-        // not supported.
+        clear_bit(ctx_no, &crcdev->ctx_busy);
+        return;
     }
-    else if (ctl & CRCDEV_INTR_FETCH_CMD_NONFULL)
+    list_del(&next->list);
+    crcdev_grant_context(next->group);
+    next->ctx_no = ctx_no;
+    if (next->granted != NULL)
+        next->granted(crcdev, next);
+    else
+        wake_up_process(next->task);
+}
+
+/* Returns a context taken by get_context or try_get_context. */
+static void put_context(struct crc_device *crcdev, int ctx_no)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&crcdev->regs_lock, flags);
+    put_context_locked(crcdev, ctx_no);
+    crcdev_start_requests(crcdev);
+    spin_unlock_irqrestore(&crcdev->regs_lock, flags);
+}
+
+/* Drops file's reference to the device. The last one lets the device be
+   removed. When the last file is closed, DMA buffers are freed after
+   idle_timeout. */
+static void crcdev_put_file(struct crc_device *crcdev)
+{
+    int files = atomic_dec_return(&crcdev->open_files);
+
+    if (files == 0)
+        complete(&crcdev->ready_to_remove_event);
+    else if (files == 1 && idle_timeout)
+        schedule_delayed_work(&crcdev->reclaim_work,
+                msecs_to_jiffies(idle_timeout));
+}
+
+/* Allocates DMA buffer of a context on its first use: pages from the
+   device's node (or the nearest one) mapped for streaming DMA. Caller must
+   own the context. */
+static int crcdev_alloc_dma_buffer(struct crc_device *crcdev, int ctx_no)
+{
+    struct page *page;
+    dma_addr_t handle;
+
+    if (crcdev->dma_buffer[ctx_no] != NULL)
+        return 0;
+    page = alloc_pages_node(crcdev->node, GFP_KERNEL,
+            get_order(BUFFER_SIZE));
+    if (page == NULL)
     {
-        // not supported.
+        dev_err(&crcdev->pcidev->dev, "Can't allocate DMA buffer.\n");
+        return -ENOMEM;
     }
-    else
+    handle = dma_map_page(&crcdev->pcidev->dev, page, 0, BUFFER_SIZE,
+            DMA_TO_DEVICE);
+    if (dma_mapping_error(&crcdev->pcidev->dev, handle))
     {
-        spin_unlock_irqrestore(&crcdev->regs_lock, flags);
-        return IRQ_NONE;
+        dev_err(&crcdev->pcidev->dev, "dma_map_page failed.\n");
+        __free_pages(page, get_order(BUFFER_SIZE));
+        return -ENOMEM;
     }
+    /* Pages of the node may have run out. */
+    if (crcdev->node >= 0 && page_to_nid(page) != crcdev->node)
+        atomic_inc(&crcdev->dma_buffer_remote);
+    crcdev->dma_buffer[ctx_no] = page_address(page);
+    crcdev->dma_handle[ctx_no] = handle;
+    return 0;
+}
 
-    spin_unlock_irqrestore(&crcdev->regs_lock, flags);
-    return IRQ_HANDLED;
+/* Hands count bytes copied to a context's DMA buffer over to the device. */
+static void crcdev_sync_dma_buffer(struct crc_device *crcdev, int ctx_no,
+                                   size_t count)
+{
+    dma_sync_single_for_device(&crcdev->pcidev->dev, crcdev->dma_handle[ctx_no],
+            count, DMA_TO_DEVICE);
 }
 
-/* Function called first. */
-static int __init crcdev_init_module(void)
+/* Frees all DMA buffers. Caller must own all contexts. */
+static void crcdev_free_dma_buffers(struct crc_device *crcdev)
 {
     int i;
-    int result = 0;
 
-    /* Initialize structures. */
-    for (i = 0; i < MAX_DEVICES; ++i)
+    for (i = 0; i < CRCDEV_CTX_COUNT; ++i)
+        if (crcdev->dma_buffer[i] != NULL)
+        {
+            dma_unmap_page(&crcdev->pcidev->dev, crcdev->dma_handle[i],
+                    BUFFER_SIZE, DMA_TO_DEVICE);
+            free_pages((unsigned long) crcdev->dma_buffer[i],
+                    get_order(BUFFER_SIZE));
+            crcdev->dma_buffer[i] = NULL;
+        }
+}
+
+/* Frees DMA buffers of a device which has no open files. */
+static void crcdev_reclaim(struct work_struct *work)
+{
+    struct crc_device *crcdev =
+        container_of(work, struct crc_device, reclaim_work.work);
+    unsigned long flags;
+    int i, idle;
+
+    /* Take all contexts, so that nobody uses the buffers. Give up if a file
+       was opened in the meantime, it will schedule us again. */
+    spin_lock_irqsave(&crcdev->regs_lock, flags);
+    idle = crcdev->ctx_busy == 0 && atomic_read(&crcdev->open_files) <= 1;
+    if (idle)
+        crcdev->ctx_busy = (1UL << CRCDEV_CTX_COUNT) - 1;
+    spin_unlock_irqrestore(&crcdev->regs_lock, flags);
+    if (!idle)
+        return;
+    crcdev_free_dma_buffers(crcdev);
+    for (i = 0; i < CRCDEV_CTX_COUNT; ++i)
+        put_context(crcdev, i);
+}
+
+/* Checks if current CPU belongs to device's NUMA node. */
+static inline int crcdev_cpu_is_local(struct crc_device *crcdev)
+{
+    return crcdev->node < 0 || numa_node_id() == crcdev->node;
+}
+
+/* Counts allocated DMA buffers. */
+static int crcdev_dma_buffers(struct crc_device *crcdev)
+{
+    int i, count = 0;
+
+    for (i = 0; i < CRCDEV_CTX_COUNT; ++i)
+        if (crcdev->dma_buffer[i] != NULL)
+            count++;
+    return count;
+}
+
+/* Shows device's statistics in sysfs. */
+static ssize_t crcdev_stats_show(struct device *dev,
+                                 struct device_attribute *attr, char *buf)
+{
+    struct crc_device *crcdev = (struct crc_device *) dev_get_drvdata(dev);
+    struct crc_stats *stats = &crcdev->stats;
+
+    static const char *irq_modes[] = { "intx", "msi", "msix" };
+
+    return scnprintf(buf, PAGE_SIZE,
+            "irq_mode %s\n"
+            "node %d\n"
+            "dma_buffers %d\n"
+            "dma_buffers_remote %d\n"
+            "irq_local %lld\n"
+            "irq_remote %lld\n"
+            "write_local %lld\n"
+            "write_remote %lld\n"
+            "bytes_remote %lld\n"
+            "cancelled %lld\n"
+            "stalls %lld\n"
+            "completions %lld\n"
+            "timer_reaps %lld\n",
+            irq_modes[crcdev->irq_mode],
+            crcdev->node,
+            crcdev_dma_buffers(crcdev),
+            atomic_read(&crcdev->dma_buffer_remote),
+            (long long) atomic64_read(&stats->irq_local),
+            (long long) atomic64_read(&stats->irq_remote),
+            (long long) atomic64_read(&stats->write_local),
+            (long long) atomic64_read(&stats->write_remote),
+            (long long) atomic64_read(&stats->bytes_remote),
+            (long long) atomic64_read(&stats->cancelled),
+            (long long) atomic64_read(&stats->stalls),
+            (long long) atomic64_read(&stats->completions),
+            (long long) atomic64_read(&stats->timer_reaps));
+}
+
+static DEVICE_ATTR(stats, S_IRUGO, crcdev_stats_show, NULL);
+
+/* Logs an operation on a file, if recording is on. */
+static void crcdev_trace(struct file_priv_data *priv_data, u8 op, u8 cmd,
+                         u32 size)
+{
+    struct crcdev_trace_rec *rec;
+
+    if (!trace || trace_buf == NULL)
+        return;
+    spin_lock(&trace_lock);
+    if (trace_tail - trace_head == TRACE_RECORDS)
     {
-        crc_devices[i] = NULL;
-        minor_status[i] = MINOR_FREE;
+        trace_lost++;
+        spin_unlock(&trace_lock);
+        return;
     }
-    
-    driver_status = WORKING;
+    rec = &trace_buf[trace_tail % TRACE_RECORDS];
+    rec->time = ktime_to_ns(ktime_get());
+    rec->file = priv_data->trace_id;
+    rec->size = size;
+    rec->minor = MINOR(priv_data->crcdev->devno);
+    rec->op = op;
+    rec->cmd = cmd;
+    rec->pad = 0;
+    trace_tail++;
+    spin_unlock(&trace_lock);
+    wake_up_interruptible(&trace_wait);
+}
 
-    /* Create class. */
-    crcdev_class = class_create(THIS_MODULE, DRIVER_NAME);
-    if (IS_ERR(crcdev_class))
+/* Hands out recorded operations, oldest first. Blocks while there are
+   none (unless O_NONBLOCK). */
+static ssize_t crcdev_trace_read(struct file *filp, char __user *buff,
+                                 size_t count, loff_t *offp)
+{
+    struct crcdev_trace_rec rec;
+    size_t done = 0;
+    int result = 0;
+
+    if (count < sizeof(rec))
+        return -EINVAL;
+    if (down_interruptible(&trace_sem))
+        return -ERESTARTSYS;
+    if (!(filp->f_flags & O_NONBLOCK))
+        result = wait_event_interruptible(trace_wait,
+                trace_head != trace_tail);
+    while (result == 0 && done + sizeof(rec) <= count)
     {
-        result = PTR_ERR(crcdev_class);
-        printk(KERN_ERR "class_create failed.\n");
-        goto fail_class_create;
+        spin_lock(&trace_lock);
+        if (trace_head == trace_tail)
+        {
+            spin_unlock(&trace_lock);
+            break;
+        }
+        rec = trace_buf[trace_head % TRACE_RECORDS];
+        trace_head++;
+        spin_unlock(&trace_lock);
+
+        if (copy_to_user(buff + done, &rec, sizeof(rec)))
+            result = -EFAULT;
+        else
+            done += sizeof(rec);
     }
+    up(&trace_sem);
+    if (done)
+        return done;
+    return result ? result : -EAGAIN;
+}
 
-    /* Register driver. */
-    result = pci_register_driver(&crcdev_driver);
+static const struct file_operations crcdev_trace_fops = {
+    .owner          = THIS_MODULE,
+    .read           = crcdev_trace_read,
+    .llseek         = no_llseek,
+};
+
+/* Sets up a group with default weight and no rate limit. */
+static void crcdev_init_group(struct crc_group *group, const char *path)
+{
+    strlcpy(group->path, path, sizeof(group->path));
+    group->weight = CRC_GROUP_WEIGHT;
+    spin_lock_init(&group->lock);
+    atomic64_set(&group->vtime, atomic64_read(&crcdev_vclock));
+}
+
+/* Must be called with crcdev_groups_lock held. */
+static struct crc_group *crcdev_find_group(const char *path)
+{
+    struct crc_group *group;
+
+    list_for_each_entry(group, &crcdev_groups, list)
+        if (strcmp(group->path, path) == 0)
+            return group;
+    return NULL;
+}
+
+/* Must be called with crcdev_groups_lock held. */
+static struct crc_group *crcdev_new_group(const char *path)
+{
+    struct crc_group *group;
+
+    group = (struct crc_group *) kzalloc(sizeof(*group), GFP_KERNEL);
+    if (group == NULL)
+        return NULL;
+    crcdev_init_group(group, path);
+    list_add_tail(&group->list, &crcdev_groups);
+    return group;
+}
+
+/* Frees a group without files and configuration. Must be called with
+   crcdev_groups_lock held. */
+static void crcdev_release_group(struct crc_group *group)
+{
+    if (group->users || group->configured || group == &crcdev_root_group)
+        return;
+    list_del(&group->list);
+    kfree(group);
+}
+
+/* Puts path of current task's cgroup in the cpu controller into path (of
+   CRC_GROUP_PATH_LEN bytes), "/" if it can't be told. */
+static void crcdev_task_group_path(char *path)
+{
+    int result = -ENOENT;
+
+#ifdef CONFIG_CGROUP_SCHED
+    rcu_read_lock();
+    result = cgroup_path(task_cgroup(current, cpu_cgroup_subsys_id), path,
+            CRC_GROUP_PATH_LEN);
+    rcu_read_unlock();
+#endif
     if (result)
+        strlcpy(path, "/", CRC_GROUP_PATH_LEN);
+}
+
+/* Takes a reference to current task's group, creating the group if needed.
+   Falls back to the root group when memory is short. */
+static struct crc_group *crcdev_get_group(void)
+{
+    struct crc_group *group = NULL;
+    char *path;
+
+    path = (char *) kmalloc(CRC_GROUP_PATH_LEN, GFP_KERNEL);
+    if (path != NULL)
+        crcdev_task_group_path(path);
+    down(&crcdev_groups_lock);
+    if (path != NULL)
     {
-        printk(KERN_ERR "pci_register_driver_failed.\n");
-        goto fail_register_driver;
+        group = crcdev_find_group(path);
+        if (group == NULL)
+            group = crcdev_new_group(path);
     }
+    if (group == NULL)
+        group = &crcdev_root_group;
+    group->users++;
+    up(&crcdev_groups_lock);
+    kfree(path);
+    return group;
+}
 
-    printk(KERN_INFO "CRC driver registered.\n");
-    return 0;
+static void crcdev_put_group(struct crc_group *group)
+{
+    down(&crcdev_groups_lock);
+    group->users--;
+    crcdev_release_group(group);
+    up(&crcdev_groups_lock);
+}
 
-fail_register_driver:
-    class_destroy(crcdev_class);
-fail_class_create:
-    return result;
+/* Charges group with device time used by its transfer and with bytes it
+   summed, which postpone the group's next submissions if it is rate
+   limited. Must be called with regs_lock held. */
+static void crcdev_charge(struct crc_group *group, s64 ns, u64 bytes)
+{
+    ktime_t now = ktime_get();
+
+    atomic64_add(ns, &group->device_ns);
+    atomic64_add(div_u64(ns * CRC_GROUP_WEIGHT, ACCESS_ONCE(group->weight)),
+            &group->vtime);
+    atomic64_add(bytes, &group->bytes);
+
+    spin_lock(&group->lock);
+    if (group->rate)
+    {
+        group->throttle_until = max_t(s64, group->throttle_until,
+                ktime_to_ns(now));
+        group->throttle_until += div64_u64(bytes * NSEC_PER_SEC, group->rate);
+    }
+    spin_unlock(&group->lock);
 }
 
-/* */
-static int crcdev_open(struct inode *inode, struct file *filp)
+/* Returns jiffies to wait until group's rate limit allows another
+   submission, 0 if it does now. Waits are short, so that changed limits
+   are noticed soon. */
+static long crcdev_throttle_delay(struct crc_group *group)
 {
-    int minor;
-    struct crc_device *crcdev;
     unsigned long flags;
-    struct crc_context *ctx;
-    struct file_priv_data *priv_data;
+    s64 now, until;
+
+    spin_lock_irqsave(&group->lock, flags);
+    until = group->rate ? group->throttle_until : 0;
+    spin_unlock_irqrestore(&group->lock, flags);
+    now = ktime_to_ns(ktime_get());
+    if (until <= now)
+        return 0;
+    return min_t(long, usecs_to_jiffies(div_u64(until - now,
+                    NSEC_PER_USEC)) + 1, HZ / 10);
+}
 
-    /* Get device associated with current file. */
-    spin_lock_irqsave(&driver_lock, flags);
-    minor = iminor(inode);
-    /* When device is about to be removed we do not handle new requests. */
-    if (device_status[minor] == REMOVE_PENDING)
-    {   
-        spin_unlock_irqrestore(&driver_lock, flags);
-        return -ENXIO;
-    }
-    crcdev = crc_devices[minor];
-    spin_unlock_irqrestore(&driver_lock, flags);
+/* Waits until group's rate limit allows another submission. Returns 0 or
+   -ERESTARTSYS. */
+static int crcdev_throttle(struct crc_group *group, int interruptible)
+{
+    s64 start = 0;
+    long timeout;
+    int result = 0;
 
-    /* Create context. */
-    ctx = (struct crc_context *) 
-        kzalloc(sizeof(struct crc_context), GFP_KERNEL);
-    if (ctx == NULL)
+    for (;;)
     {
-        goto fail_ctx_alloc;
+        timeout = crcdev_throttle_delay(group);
+        if (timeout == 0)
+            break;
+        if (start == 0)
+            start = ktime_to_ns(ktime_get());
+        if (!interruptible)
+            schedule_timeout_uninterruptible(timeout);
+        else if (schedule_timeout_interruptible(timeout) &&
+                signal_pending(current))
+        {
+            result = -ERESTARTSYS;
+            break;
+        }
     }
-    /* Create file's private data. */
-    priv_data = (struct file_priv_data *)
-        kzalloc(sizeof(struct file_priv_data), GFP_KERNEL);
-    if (priv_data == NULL)
+    if (start)
+        atomic64_add(ktime_to_ns(ktime_get()) - start, &group->throttled_ns);
+    return result;
+}
+
+/* Lists groups with their configuration and usage. */
+static int crcdev_groups_show(struct seq_file *m, void *v)
+{
+    struct crc_group *group;
+
+    seq_printf(m, "%-32s %6s %12s %16s %14s %14s %5s\n", "group", "weight",
+            "rate", "bytes", "device_us", "throttled_us", "files");
+    down(&crcdev_groups_lock);
+    list_for_each_entry(group, &crcdev_groups, list)
     {
-        goto fail_priv_data_alloc;
+        seq_printf(m, "%-32s %6u %12llu %16llu %14llu %14llu %5d\n",
+                group->path, group->weight,
+                (unsigned long long) group->rate,
+                (unsigned long long) atomic64_read(&group->bytes),
+                (unsigned long long) div_u64(
+                    atomic64_read(&group->device_ns), NSEC_PER_USEC),
+                (unsigned long long) div_u64(
+                    atomic64_read(&group->throttled_ns), NSEC_PER_USEC),
+                group->users);
     }
-    /* Initialize file's private data. */
-    priv_data->ctx = ctx;
-    priv_data->crcdev = crcdev;
-    filp->private_data = priv_data;
-    sema_init(&priv_data->sem_file, 1);
-    spin_lock_irqsave(&crcdev->regs_lock, flags);
-    crcdev->open_files++;
-    spin_unlock_irqrestore(&crcdev->regs_lock, flags);
+    up(&crcdev_groups_lock);
     return 0;
+}
 
-fail_priv_data_alloc:
-    kfree(ctx);
-fail_ctx_alloc:
-    return 1;
+static int crcdev_groups_open(struct inode *inode, struct file *filp)
+{
+    return single_open(filp, crcdev_groups_show, NULL);
 }
 
-/* */
-static int crcdev_release(struct inode *inode, struct file *filp)
+/* Configures a group: "<path> <weight> <rate>", rate in bytes per second
+   (0 - unlimited). Weight CRC_GROUP_WEIGHT and rate 0 bring defaults
+   back. */
+static ssize_t crcdev_groups_write(struct file *filp, const char __user *buff,
+                                   size_t count, loff_t *offp)
 {
-    struct file_priv_data *priv_data;
-    struct crc_device *crcdev;
-    struct crc_context *ctx;
-    unsigned long flags, flags2;
-    int minor;
+    struct crc_group *group;
+    char *line, *path;
+    unsigned int weight;
+    unsigned long long rate;
+    ssize_t result = count;
+
+    if (count >= 2 * CRC_GROUP_PATH_LEN)
+        return -EINVAL;
+    line = (char *) kmalloc(2 * (count + 1), GFP_KERNEL);
+    if (line == NULL)
+        return -ENOMEM;
+    path = line + count + 1;
+    if (copy_from_user(line, buff, count))
+    {
+        kfree(line);
+        return -EFAULT;
+    }
+    line[count] = 0;
+    if (sscanf(line, "%s %u %llu", path, &weight, &rate) != 3 ||
+            path[0] != '/' || strlen(path) >= CRC_GROUP_PATH_LEN ||
+            weight == 0)
+    {
+        kfree(line);
+        return -EINVAL;
+    }
 
-    minor = iminor(inode);
-    priv_data = (struct file_priv_data *) filp->private_data;
-    crcdev = (struct crc_device *) priv_data->crcdev;
-    ctx = (struct crc_context *) priv_data->ctx;
-    kfree(ctx);
-    kfree(priv_data);
+    down(&crcdev_groups_lock);
+    group = crcdev_find_group(path);
+    if (group == NULL)
+        group = crcdev_new_group(path);
+    if (group == NULL)
+        result = -ENOMEM;
+    else
+    {
+        group->weight = weight;
+        spin_lock_irq(&group->lock);
+        group->rate = rate;
+        group->throttle_until = 0;
+        spin_unlock_irq(&group->lock);
+        group->configured = weight != CRC_GROUP_WEIGHT || rate != 0;
+        crcdev_release_group(group);
+    }
+    up(&crcdev_groups_lock);
+    kfree(line);
+    return result;
+}
 
-    spin_lock_irqsave(&crcdev->regs_lock, flags);
-    crcdev->open_files--;
-    if (crcdev->open_files == 0)
+static const struct file_operations crcdev_groups_fops = {
+    .owner          = THIS_MODULE,
+    .open           = crcdev_groups_open,
+    .read           = seq_read,
+    .write          = crcdev_groups_write,
+    .llseek         = seq_lseek,
+    .release        = single_release,
+};
+
+/* Adds time since start to a usage counter of a file. */
+static inline void crcdev_usage_add(atomic64_t *counter, ktime_t start)
+{
+    atomic64_add(ktime_to_ns(ktime_sub(ktime_get(), start)), counter);
+}
+
+/* Reads file's usage. Memory is counted from the file's current buffers, so
+   it may be a bit off while the file is being used. */
+static void crcdev_get_usage(struct file_priv_data *priv_data,
+                             struct crcdev_ioctl_usage *res)
+{
+    struct crc_file_usage *usage = &priv_data->usage;
+
+    res->bytes = atomic64_read(&usage->bytes);
+    res->transfers = atomic64_read(&usage->transfers);
+    res->device_ns = atomic64_read(&usage->device_ns);
+    res->ctx_wait_ns = atomic64_read(&usage->ctx_wait_ns);
+    res->queue_wait_ns = atomic64_read(&usage->queue_wait_ns);
+    res->copy_ns = atomic64_read(&usage->copy_ns);
+    res->pinned = atomic64_read(&usage->pinned);
+    res->memory = sizeof(*priv_data) +
+        ACCESS_ONCE(priv_data->nr_streams) * sizeof(struct crc_stream);
+    if (ACCESS_ONCE(priv_data->buffer) != NULL)
+        res->memory += BUFFER_SIZE;
+    if (ACCESS_ONCE(priv_data->cq) != NULL)
+        res->memory += CRCDEV_ASYNC_DEPTH * sizeof(struct crcdev_ioctl_cqe);
+}
+
+/* Lists usage of open files summed per process which opened them. */
+static int crcdev_clients_show(struct seq_file *m, void *v)
+{
+    struct file_priv_data *priv_data, *other;
+    struct crcdev_ioctl_usage sum, usage;
+    int nr_files;
+
+    seq_printf(m, "%-7s %-16s %5s %16s %10s %12s %12s %12s %12s %12s "
+            "%10s\n", "pid", "comm", "files", "bytes", "transfers",
+            "device_us", "ctx_wait_us", "queue_us", "copy_us", "pinned",
+            "memory");
+    down(&crcdev_files_lock);
+    list_for_each_entry(priv_data, &crcdev_files, files)
     {
-        spin_lock_irqsave(&driver_lock, flags2);
-        if (device_status[minor] == REMOVE_PENDING)
+        /* A process is listed at its first file. */
+        list_for_each_entry(other, &crcdev_files, files)
+            if (other == priv_data || other->pid == priv_data->pid)
+                break;
+        if (other != priv_data)
+            continue;
+
+        memset(&sum, 0, sizeof(sum));
+        nr_files = 0;
+        other = priv_data;
+        list_for_each_entry_from(other, &crcdev_files, files)
         {
-            complete(&crcdev->ready_to_remove_event);
+            if (other->pid != priv_data->pid)
+                continue;
+            crcdev_get_usage(other, &usage);
+            sum.bytes += usage.bytes;
+            sum.transfers += usage.transfers;
+            sum.device_ns += usage.device_ns;
+            sum.ctx_wait_ns += usage.ctx_wait_ns;
+            sum.queue_wait_ns += usage.queue_wait_ns;
+            sum.copy_ns += usage.copy_ns;
+            sum.pinned += usage.pinned;
+            sum.memory += usage.memory;
+            nr_files++;
         }
-        spin_unlock_irqrestore(&driver_lock, flags2);
+        seq_printf(m, "%-7d %-16s %5d %16llu %10llu %12llu %12llu %12llu "
+                "%12llu %12llu %10llu\n", priv_data->pid, priv_data->comm,
+                nr_files, (unsigned long long) sum.bytes,
+                (unsigned long long) sum.transfers,
+                (unsigned long long) div_u64(sum.device_ns, NSEC_PER_USEC),
+                (unsigned long long) div_u64(sum.ctx_wait_ns, NSEC_PER_USEC),
+                (unsigned long long) div_u64(sum.queue_wait_ns,
+                    NSEC_PER_USEC),
+                (unsigned long long) div_u64(sum.copy_ns, NSEC_PER_USEC),
+                (unsigned long long) sum.pinned,
+                (unsigned long long) sum.memory);
     }
-    spin_unlock_irqrestore(&crcdev->regs_lock, flags);
+    up(&crcdev_files_lock);
     return 0;
 }
 
-/* */
-static ssize_t crcdev_write(struct file *filp, const char __user *buff,
-                            size_t count, loff_t *offp)
+static int crcdev_clients_open(struct inode *inode, struct file *filp)
 {
-    struct file_priv_data *priv_data;
-    struct crc_device *crcdev;
-    struct crc_context *ctx;
-    int ctx_no = -1;
-    unsigned long flags;
-    size_t sent = 0, to_send;
-    int result;
+    return single_open(filp, crcdev_clients_show, NULL);
+}
 
-    priv_data = (struct file_priv_data *) filp->private_data;
-    crcdev = (struct crc_device *) priv_data->crcdev;
-    ctx = (struct crc_context *) priv_data->ctx;
-    
-    /* Only one thread can "work" with file at the same time. */
-    if (down_interruptible(&priv_data->sem_file))
+static const struct file_operations crcdev_clients_fops = {
+    .owner          = THIS_MODULE,
+    .open           = crcdev_clients_open,
+    .read           = seq_read,
+    .llseek         = seq_lseek,
+    .release        = single_release,
+};
+
+/* Creates debugfs entries. They are optional, so failures only disable
+   them. */
+static void crcdev_debugfs_init(void)
+{
+    crcdev_init_group(&crcdev_root_group, "/");
+    list_add(&crcdev_root_group.list, &crcdev_groups);
+
+    crcdev_debugfs = debugfs_create_dir(DRIVER_NAME, NULL);
+    if (IS_ERR_OR_NULL(crcdev_debugfs))
+    {
+        crcdev_debugfs = NULL;
+        return;
+    }
+    debugfs_create_file("groups", S_IRUSR | S_IWUSR, crcdev_debugfs, NULL,
+            &crcdev_groups_fops);
+    debugfs_create_file("clients", S_IRUSR, crcdev_debugfs, NULL,
+            &crcdev_clients_fops);
+    trace_buf = vmalloc(TRACE_RECORDS * sizeof(struct crcdev_trace_rec));
+    if (trace_buf == NULL)
+    {
+        printk(KERN_WARNING "Can't allocate trace buffer.\n");
+        return;
+    }
+    debugfs_create_file("trace", S_IRUSR, crcdev_debugfs, NULL,
+            &crcdev_trace_fops);
+    debugfs_create_u32("trace_lost", S_IRUSR, crcdev_debugfs, &trace_lost);
+}
+
+static void crcdev_debugfs_exit(void)
+{
+    struct crc_group *group, *tmp;
+
+    debugfs_remove_recursive(crcdev_debugfs);
+    vfree(trace_buf);
+    /* Only configured groups are left. */
+    list_for_each_entry_safe(group, tmp, &crcdev_groups, list)
+    {
+        list_del(&group->list);
+        if (group != &crcdev_root_group)
+            kfree(group);
+    }
+}
+
+/* Period of the coalescing timer: coalesce_usecs, or request_timeout if it
+   only checks for stalls (0 - the timer is off). */
+static u64 crcdev_timer_period_ns(void)
+{
+    if (coalesce_usecs)
+        return (u64) coalesce_usecs * NSEC_PER_USEC;
+    return (u64) request_timeout * NSEC_PER_MSEC;
+}
+
+/* Enables the idle interrupt of fetch cmd block and the coalescing timer
+   while there are commands in the ring. The timer stops itself under
+   regs_lock when the ring is empty, so it is started again here even if its
+   last run is still returning. Must be called with regs_lock held. */
+static void crcdev_arm_completion(struct crc_device *crcdev)
+{
+    int busy = crcdev->nr_inflight > 0;
+
+    if (busy != crcdev->idle_irq)
+    {
+        iowrite32(busy ? CRCDEV_INTR_FETCH_CMD_IDLE : 0,
+                crcdev->addr + CRCDEV_INTR_ENABLE);
+        crcdev->idle_irq = busy;
+    }
+    if (busy && crcdev_timer_period_ns() && !crcdev->timer_armed)
+    {
+        crcdev->timer_armed = 1;
+        hrtimer_start(&crcdev->coalesce_timer,
+                ns_to_ktime(crcdev_timer_period_ns()), HRTIMER_MODE_REL);
+    }
+}
+
+/* Writes the command of a request at pos of the ring. Must be called with
+   regs_lock held. */
+static void crcdev_write_command(struct crc_device *crcdev,
+                                 struct crc_request *req, unsigned int pos)
+{
+    __le32 *cmd = crcdev->cmd_ring + pos * (CRCDEV_CMD_SIZE / 4);
+
+    cmd[0] = cpu_to_le32(req->addr);
+    cmd[1] = cpu_to_le32(req->count | req->ctx_no << CRCDEV_CMD_CTX_SHIFT);
+}
+
+/* Puts ready requests into the ring of fetch cmd block until coalesce_count
+   of them are in flight. Groups are scheduled by weight when contexts are
+   handed out, requests are started in order. Must be called with regs_lock
+   held. */
+static void crcdev_start_requests(struct crc_device *crcdev)
+{
+    struct crc_request *req;
+    unsigned int depth = clamp_t(unsigned int, coalesce_count, 1,
+            CRCDEV_CMD_RING_SIZE - 1);
+    unsigned int write_pos = crcdev->cmd_write_pos;
+
+    while (crcdev->nr_inflight < depth && !list_empty(&crcdev->ready))
     {
-        return sent;
+        req = list_first_entry(&crcdev->ready, struct crc_request, list);
+        list_move_tail(&req->list, &crcdev->inflight);
+        req->state = REQ_ACTIVE;
+        if (req->usage != NULL)
+            crcdev_usage_add(&req->usage->queue_wait_ns, req->submitted);
+        if (crcdev->nr_inflight++ == 0)
+            crcdev->ring_progress = ktime_get();
+
+        /* No other command of the context is in the ring, so its registers
+           can be set now. */
+        if (req->load)
+        {
+            iowrite32(req->sum, crcdev->addr + CRCDEV_CRC_SUM(req->ctx_no));
+            iowrite32(req->poly, crcdev->addr + CRCDEV_CRC_POLY(req->ctx_no));
+        }
+        crcdev_write_command(crcdev, req, write_pos);
+        write_pos = (write_pos + 1) % CRCDEV_CMD_RING_SIZE;
+    }
+    if (write_pos != crcdev->cmd_write_pos)
+    {
+        crcdev->cmd_write_pos = write_pos;
+        /* Commands must be in memory before the device sees them. */
+        wmb();
+        iowrite32(write_pos, crcdev->addr + CRCDEV_FETCH_CMD_WRITE_POS);
+    }
+    crcdev_arm_completion(crcdev);
+}
+
+/* Signals the submitter of a finished or withdrawn request (or calls its
+   callback). Must be called with regs_lock held. */
+static void crcdev_complete_request(struct crc_device *crcdev,
+                                    struct crc_request *req)
+{
+    req->state = REQ_DONE;
+    if (req->callback != NULL)
+        req->callback(crcdev, req);
+    else
+        complete(&req->done);
+}
+
+/* Completes all requests whose commands fetch cmd block has finished.
+   Device time since the ring last made progress is split among them by
+   size. Returns number of completed requests. Must be called with regs_lock
+   held. */
+static int crcdev_ring_done(struct crc_device *crcdev)
+{
+    LIST_HEAD(done);
+    struct crc_request *req, *tmp;
+    unsigned int read_pos, n;
+    ktime_t now;
+    s64 ns, share;
+    u64 bytes = 0;
+    int nr_done = 0;
+
+    /* Idle interrupt coming after this point means there is more to reap. */
+    iowrite32(CRCDEV_INTR_FETCH_CMD_IDLE, crcdev->addr + CRCDEV_INTR);
+    read_pos = ioread32(crcdev->addr + CRCDEV_FETCH_CMD_READ_POS);
+    n = (read_pos + CRCDEV_CMD_RING_SIZE - crcdev->cmd_read_pos) %
+        CRCDEV_CMD_RING_SIZE;
+    crcdev->cmd_read_pos = read_pos;
+    for (; n > 0 && crcdev->nr_inflight > 0; --n)
+    {
+        req = list_first_entry(&crcdev->inflight, struct crc_request, list);
+        list_move_tail(&req->list, &done);
+        crcdev->nr_inflight--;
+        bytes += req->count;
+        nr_done++;
+    }
+    if (nr_done == 0)
+        return 0;
+
+    now = ktime_get();
+    ns = ktime_to_ns(ktime_sub(now, crcdev->ring_progress));
+    crcdev->ring_progress = now;
+    list_for_each_entry_safe(req, tmp, &done, list)
+    {
+        share = div64_u64(ns * req->count, bytes);
+        crcdev_charge(req->group, share, req->count);
+        if (req->usage != NULL)
+        {
+            atomic64_add(share, &req->usage->device_ns);
+            atomic64_add(req->count, &req->usage->bytes);
+            atomic64_inc(&req->usage->transfers);
+        }
+        req->sum = ioread32(crcdev->addr + CRCDEV_CRC_SUM(req->ctx_no));
+        list_del(&req->list);
+        atomic64_inc(&crcdev->stats.completions);
+        crcdev_complete_request(crcdev, req);
+    }
+    return nr_done;
+}
+
+/* Completes finished requests together and refills the ring. Returns
+   number of completed requests. Must be called with regs_lock held. */
+static int crcdev_ring_reap(struct crc_device *crcdev)
+{
+    int nr_done = crcdev_ring_done(crcdev);
+
+    crcdev_start_requests(crcdev);
+    return nr_done;
+}
+
+/* Handles idle interrupt of fetch cmd block. Must be called with regs_lock
+   held. */
+static void crcdev_fetch_cmd_idle(struct crc_device *crcdev)
+{
+    if (crcdev_cpu_is_local(crcdev))
+        atomic64_inc(&crcdev->stats.irq_local);
+    else
+        atomic64_inc(&crcdev->stats.irq_remote);
+    crcdev_ring_reap(crcdev);
+}
+
+/* Stops fetch cmd block and fails the request whose command got stuck
+   with result. Requests behind it didn't start, they go back to the head of
+   the ready list in order. States of contexts are lost, so all of them
+   load their contexts again. Must be called with regs_lock held. */
+static void crcdev_reset_ring(struct crc_device *crcdev, int result)
+{
+    struct crc_request *req;
+    u32 enable = ioread32(crcdev->addr + CRCDEV_ENABLE);
+
+    iowrite32(enable & ~CRCDEV_ENABLE_FETCH_CMD, crcdev->addr + CRCDEV_ENABLE);
+    crcdev_ring_done(crcdev);
+    if (!list_empty(&crcdev->inflight))
+    {
+        req = list_first_entry(&crcdev->inflight, struct crc_request, list);
+        crcdev_charge(req->group, ktime_to_ns(ktime_sub(ktime_get(),
+                        crcdev->ring_progress)), 0);
+        req->result = result;
+        list_del(&req->list);
+        crcdev_complete_request(crcdev, req);
+    }
+    list_for_each_entry(req, &crcdev->inflight, list)
+    {
+        req->state = REQ_READY;
+        req->load = 1;
+    }
+    list_splice_init(&crcdev->inflight, &crcdev->ready);
+    crcdev->nr_inflight = 0;
+    crcdev->cmd_read_pos = 0;
+    crcdev->cmd_write_pos = 0;
+    iowrite32(0, crcdev->addr + CRCDEV_FETCH_CMD_READ_POS);
+    iowrite32(0, crcdev->addr + CRCDEV_FETCH_CMD_WRITE_POS);
+    iowrite32(enable, crcdev->addr + CRCDEV_ENABLE);
+    crcdev_start_requests(crcdev);
+}
+
+/* Whether the ring of fetch cmd block hasn't moved for request_timeout.
+   Must be called with regs_lock held. */
+static int crcdev_ring_stalled(struct crc_device *crcdev)
+{
+    return request_timeout && crcdev->nr_inflight > 0 &&
+        ktime_to_us(ktime_sub(ktime_get(), crcdev->ring_progress)) >=
+        request_timeout * 1000LL;
+}
+
+/* If the ring is stalled, it is reset, so that the following requests can
+   run. Must be called with regs_lock held. */
+static void crcdev_check_stall_locked(struct crc_device *crcdev)
+{
+    if (crcdev_ring_stalled(crcdev))
+    {
+        dev_warn(&crcdev->pcidev->dev,
+                "Fetch cmd block stalled, resetting it.\n");
+        atomic64_inc(&crcdev->stats.stalls);
+        crcdev_reset_ring(crcdev, -ETIMEDOUT);
+    }
+}
+
+/* Called when a request timed out. */
+static void crcdev_check_stall(struct crc_device *crcdev)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&crcdev->regs_lock, flags);
+    /* Commands whose interrupt didn't come are progress too. */
+    crcdev_ring_reap(crcdev);
+    crcdev_check_stall_locked(crcdev);
+    spin_unlock_irqrestore(&crcdev->regs_lock, flags);
+}
+
+/* Resets a ring the timer found stalled, outside of interrupt context. */
+static void crcdev_stall_work(struct work_struct *work)
+{
+    crcdev_check_stall(container_of(work, struct crc_device, stall_work));
+}
+
+/* Reaps commands finished while the ring is still busy, so that they don't
+   wait for the last one for longer than coalesce_usecs. Nobody waits for
+   transfers of asynchronous jobs with a timeout, so stalls are noticed here
+   (also when coalescing is off) and left to crcdev_wq. */
+static enum hrtimer_restart crcdev_coalesce_timer(struct hrtimer *timer)
+{
+    struct crc_device *crcdev =
+        container_of(timer, struct crc_device, coalesce_timer);
+    enum hrtimer_restart restart = HRTIMER_RESTART;
+    unsigned long flags;
+
+    spin_lock_irqsave(&crcdev->regs_lock, flags);
+    if (crcdev_ring_reap(crcdev))
+        atomic64_inc(&crcdev->stats.timer_reaps);
+    if (crcdev_ring_stalled(crcdev))
+        queue_work(crcdev_wq, &crcdev->stall_work);
+    /* Decided under the lock, so that a request started right after this
+       arms the timer again. */
+    if (crcdev->nr_inflight == 0 || crcdev_timer_period_ns() == 0)
+    {
+        crcdev->timer_armed = 0;
+        restart = HRTIMER_NORESTART;
+    }
+    else
+        hrtimer_forward_now(timer, ns_to_ktime(crcdev_timer_period_ns()));
+    spin_unlock_irqrestore(&crcdev->regs_lock, flags);
+    return restart;
+}
+
+/* Takes a request out of the ring if the device hasn't started its command,
+   i.e. it isn't the first one not done. Fetch cmd block is stopped
+   meanwhile, as when the ring is reset, and the commands behind the
+   request are moved up. Returns whether the
+   request was taken out. Must be called with regs_lock held. */
+static int crcdev_withdraw_from_ring(struct crc_device *crcdev,
+                                     struct crc_request *req)
+{
+    struct crc_request *next;
+    unsigned int pos;
+    u32 enable = ioread32(crcdev->addr + CRCDEV_ENABLE);
+    int withdrawn = 0;
+
+    iowrite32(enable & ~CRCDEV_ENABLE_FETCH_CMD, crcdev->addr + CRCDEV_ENABLE);
+    crcdev_ring_done(crcdev);
+    if (req->state == REQ_ACTIVE &&
+            req != list_first_entry(&crcdev->inflight, struct crc_request,
+                list))
+    {
+        list_del(&req->list);
+        crcdev->nr_inflight--;
+        /* Commands in the ring are in the order of inflight. */
+        pos = crcdev->cmd_read_pos;
+        list_for_each_entry(next, &crcdev->inflight, list)
+        {
+            crcdev_write_command(crcdev, next, pos);
+            pos = (pos + 1) % CRCDEV_CMD_RING_SIZE;
+        }
+        crcdev->cmd_write_pos = pos;
+        wmb();
+        iowrite32(pos, crcdev->addr + CRCDEV_FETCH_CMD_WRITE_POS);
+        withdrawn = 1;
+    }
+    iowrite32(enable, crcdev->addr + CRCDEV_ENABLE);
+    /* Reaped commands and the withdrawn one left room in the ring. */
+    crcdev_start_requests(crcdev);
+    return withdrawn;
+}
+
+/* Withdraws a request whose submitter stopped waiting and waits until
+   neither the device nor the dispatcher use it. A request in the ring is
+   taken out of it unless the device already started it; that one is waited
+   for (the ring is reset if it stalls). Returns result of the request, 0 if
+   it was done. */
+static int crcdev_cancel_request(struct crc_device *crcdev,
+                                 struct crc_request *req, int result)
+{
+    long timeout = request_timeout ? msecs_to_jiffies(request_timeout) :
+        MAX_SCHEDULE_TIMEOUT;
+    unsigned long flags;
+
+    spin_lock_irqsave(&crcdev->regs_lock, flags);
+    if (req->state == REQ_QUEUED || req->state == REQ_READY ||
+            (req->state == REQ_ACTIVE &&
+             crcdev_withdraw_from_ring(crcdev, req)))
+    {
+        atomic64_inc(&crcdev->stats.cancelled);
+        req->result = result;
+        req->cancelled = 1;
+        if (req->state == REQ_READY)
+        {
+            list_del(&req->list);
+            crcdev_complete_request(crcdev, req);
+        }
+        else if (req->state == REQ_ACTIVE)
+            crcdev_complete_request(crcdev, req);
+    }
+    spin_unlock_irqrestore(&crcdev->regs_lock, flags);
+    /* Requests still in a CPU queue are dropped by the dispatcher soon. */
+    while (!wait_for_completion_timeout(&req->done, timeout))
+        crcdev_check_stall(crcdev);
+    return req->result;
+}
+
+/* Queues request on current CPU's queue and kicks the dispatcher. Nothing
+   is locked here. */
+static void crcdev_submit(struct crc_device *crcdev, struct crc_request *req)
+{
+    struct crc_cpu_queue *queue;
+
+    init_completion(&req->done);
+    req->submitted = ktime_get();
+    req->state = REQ_QUEUED;
+    req->cancelled = 0;
+    req->result = 0;
+    req->callback = NULL;
+    queue = per_cpu_ptr(crcdev->queues, get_cpu());
+    llist_add(&req->queue_node, &queue->requests);
+    put_cpu();
+
+    if (atomic_cmpxchg(&crcdev->dispatch_pending, 0, 1) == 0)
+        wake_up_process(crcdev->dispatcher);
+}
+
+/* Moves requests from all CPU queues to device's ready list. CPU queues are
+   visited starting from a different CPU each round, so that no CPU is always
+   served first. */
+static void crcdev_collect_requests(struct crc_device *crcdev)
+{
+    LIST_HEAD(requests);
+    LIST_HEAD(cpu_requests);
+    struct crc_cpu_queue *queue;
+    struct llist_node *first;
+    struct crc_request *req, *tmp;
+    unsigned long flags;
+    int i, cpu;
+
+    for (i = 0; i < nr_cpu_ids; ++i)
+    {
+        cpu = (crcdev->dispatch_cpu + i) % nr_cpu_ids;
+        if (!cpu_possible(cpu))
+            continue;
+        queue = per_cpu_ptr(crcdev->queues, cpu);
+        if (llist_empty(&queue->requests))
+            continue;
+        /* Newest first, adding each to the head restores the order. */
+        first = llist_del_all(&queue->requests);
+        llist_for_each_entry(req, first, queue_node)
+            list_add(&req->list, &cpu_requests);
+        list_splice_tail_init(&cpu_requests, &requests);
+    }
+    crcdev->dispatch_cpu = (crcdev->dispatch_cpu + 1) % nr_cpu_ids;
+
+    if (list_empty(&requests))
+        return;
+    spin_lock_irqsave(&crcdev->regs_lock, flags);
+    list_for_each_entry_safe(req, tmp, &requests, list)
+    {
+        if (req->cancelled)
+        {
+            list_del(&req->list);
+            crcdev_complete_request(crcdev, req);
+        }
+        else
+            req->state = REQ_READY;
+    }
+    list_splice_tail_init(&requests, &crcdev->ready);
+    crcdev_start_requests(crcdev);
+    spin_unlock_irqrestore(&crcdev->regs_lock, flags);
+}
+
+/* Dispatcher thread. Next requests are started by the interrupt handler, the
+   dispatcher only feeds the ready list. */
+static int crcdev_dispatcher(void *data)
+{
+    struct crc_device *crcdev = (struct crc_device *) data;
+
+    for (;;)
+    {
+        set_current_state(TASK_INTERRUPTIBLE);
+        if (kthread_should_stop())
+            break;
+        if (atomic_xchg(&crcdev->dispatch_pending, 0) == 0)
+        {
+            schedule();
+            continue;
+        }
+        __set_current_state(TASK_RUNNING);
+        crcdev_collect_requests(crcdev);
+    }
+    __set_current_state(TASK_RUNNING);
+    return 0;
+}
+
+/* Interrupt handler for (shared) INTx line. */
+static irqreturn_t crcdev_irq_handler(int irq, void *data)
+{
+    struct crc_device *crcdev = (struct crc_device *) data;
+    u32 ctl;
+    unsigned long flags;
+    spin_lock_irqsave(&crcdev->regs_lock, flags);
+    /* Only enabled interrupts are ours, other bits (e.g. CMD_NONFULL) may
+       be set all the time. */
+    ctl = ioread32(crcdev->addr + CRCDEV_INTR) &
+        ioread32(crcdev->addr + CRCDEV_INTR_ENABLE);
+
+    if (ctl & CRCDEV_INTR_FETCH_CMD_IDLE)
+    {
+        crcdev_fetch_cmd_idle(crcdev);
+    }
+    else
+    {
+        spin_unlock_irqrestore(&crcdev->regs_lock, flags);
+        return IRQ_NONE;
+    }
+
+    spin_unlock_irqrestore(&crcdev->regs_lock, flags);
+    return IRQ_HANDLED;
+}
+
+/* Interrupt handler for fetch data MSI-X vector. Fetch data interrupts are
+   not enabled, all transfers go through fetch cmd block; the vector is
+   requested so that the device's vectors are set up consistently. */
+static irqreturn_t crcdev_msi_data_handler(int irq, void *data)
+{
+    return IRQ_HANDLED;
+}
+
+/* Interrupt handler for MSI and fetch cmd MSI-X vector. The interrupt is
+   not shared, so there is no need to read CRCDEV_INTR. */
+static irqreturn_t crcdev_msi_cmd_handler(int irq, void *data)
+{
+    struct crc_device *crcdev = (struct crc_device *) data;
+    unsigned long flags;
+
+    spin_lock_irqsave(&crcdev->regs_lock, flags);
+    crcdev_fetch_cmd_idle(crcdev);
+    spin_unlock_irqrestore(&crcdev->regs_lock, flags);
+    return IRQ_HANDLED;
+}
+
+/* Enables MSI-X (separate vectors for fetch data and fetch cmd blocks) or
+   MSI, falls back to INTx. Requests interrupts and steers them to CPUs local
+   to the device. */
+static int crcdev_setup_irq(struct crc_device *crcdev)
+{
+    struct pci_dev *pcidev = crcdev->pcidev;
+    irq_handler_t handler;
+    int result = 0;
+    int i;
+
+    for (i = 0; i < IRQ_VECTORS; ++i)
+        crcdev->msix_entries[i].entry = i;
+
+    if (pci_enable_msix(pcidev, crcdev->msix_entries, IRQ_VECTORS) == 0)
+    {
+        crcdev->irq_mode = IRQ_MODE_MSIX;
+        crcdev->nr_irqs = IRQ_VECTORS;
+        for (i = 0; i < IRQ_VECTORS; ++i)
+            crcdev->irq[i] = crcdev->msix_entries[i].vector;
+    }
+    else if (pci_enable_msi(pcidev) == 0)
+    {
+        crcdev->irq_mode = IRQ_MODE_MSI;
+        crcdev->nr_irqs = 1;
+        crcdev->irq[IRQ_VECTOR_DATA] = pcidev->irq;
+    }
+    else
+    {
+        crcdev->irq_mode = IRQ_MODE_INTX;
+        crcdev->nr_irqs = 1;
+        crcdev->irq[IRQ_VECTOR_DATA] = pcidev->irq;
+    }
+
+    for (i = 0; i < crcdev->nr_irqs; ++i)
+    {
+        if (crcdev->irq_mode == IRQ_MODE_INTX)
+            handler = crcdev_irq_handler;
+        else if (crcdev->irq_mode == IRQ_MODE_MSIX && i == IRQ_VECTOR_DATA)
+            handler = crcdev_msi_data_handler;
+        else
+            handler = crcdev_msi_cmd_handler;
+
+        result = request_irq(crcdev->irq[i], handler,
+                crcdev->irq_mode == IRQ_MODE_INTX ? IRQF_SHARED : 0,
+                DRIVER_NAME, crcdev);
+        if (result)
+        {
+            dev_err(&pcidev->dev, "request_irq failed.\n");
+            goto fail_request_irq;
+        }
+        /* Handle interrupts (and so wake up writers) on CPUs local to the
+           device. */
+        if (crcdev->node >= 0)
+            irq_set_affinity_hint(crcdev->irq[i],
+                    cpumask_of_node(crcdev->node));
+    }
+    return 0;
+
+fail_request_irq:
+    while (--i >= 0)
+    {
+        irq_set_affinity_hint(crcdev->irq[i], NULL);
+        free_irq(crcdev->irq[i], crcdev);
+    }
+    if (crcdev->irq_mode == IRQ_MODE_MSIX)
+        pci_disable_msix(pcidev);
+    else if (crcdev->irq_mode == IRQ_MODE_MSI)
+        pci_disable_msi(pcidev);
+    return result;
+}
+
+/* Releases interrupts requested by crcdev_setup_irq. */
+static void crcdev_free_irq(struct crc_device *crcdev)
+{
+    int i;
+
+    for (i = 0; i < crcdev->nr_irqs; ++i)
+    {
+        irq_set_affinity_hint(crcdev->irq[i], NULL);
+        free_irq(crcdev->irq[i], crcdev);
+    }
+    if (crcdev->irq_mode == IRQ_MODE_MSIX)
+        pci_disable_msix(crcdev->pcidev);
+    else if (crcdev->irq_mode == IRQ_MODE_MSI)
+        pci_disable_msi(crcdev->pcidev);
+}
+
+/* Function called first. */
+static int __init crcdev_init_module(void)
+{
+    int result = 0;
+
+    /* Initialize structures. */
+    idr_init(&crc_devices);
+    driver_status = WORKING;
+    crcdev_debugfs_init();
+
+    /* Create cache for files' private data. */
+    crcdev_file_cache = kmem_cache_create("crcdev_file",
+            sizeof(struct file_priv_data), 0, SLAB_HWCACHE_ALIGN, NULL);
+    if (crcdev_file_cache == NULL)
+    {
+        result = -ENOMEM;
+        printk(KERN_ERR "kmem_cache_create failed.\n");
+        goto fail_cache_create;
+    }
+
+    /* Create cache and workqueue for asynchronous requests. */
+    crcdev_job_cache = kmem_cache_create("crcdev_job",
+            sizeof(struct crc_async_job), 0, SLAB_HWCACHE_ALIGN, NULL);
+    if (crcdev_job_cache == NULL)
+    {
+        result = -ENOMEM;
+        printk(KERN_ERR "kmem_cache_create failed.\n");
+        goto fail_job_cache_create;
+    }
+    crcdev_wq = alloc_workqueue(DRIVER_NAME, WQ_UNBOUND, 0);
+    if (crcdev_wq == NULL)
+    {
+        result = -ENOMEM;
+        printk(KERN_ERR "alloc_workqueue failed.\n");
+        goto fail_alloc_workqueue;
+    }
+
+    /* Create class. */
+    crcdev_class = class_create(THIS_MODULE, DRIVER_NAME);
+    if (IS_ERR(crcdev_class))
+    {
+        result = PTR_ERR(crcdev_class);
+        printk(KERN_ERR "class_create failed.\n");
+        goto fail_class_create;
+    }
+
+    /* Register driver. */
+    result = pci_register_driver(&crcdev_driver);
+    if (result)
+    {
+        printk(KERN_ERR "pci_register_driver_failed.\n");
+        goto fail_register_driver;
+    }
+
+    printk(KERN_INFO "CRC driver registered.\n");
+    return 0;
+
+fail_register_driver:
+    class_destroy(crcdev_class);
+fail_class_create:
+    destroy_workqueue(crcdev_wq);
+fail_alloc_workqueue:
+    kmem_cache_destroy(crcdev_job_cache);
+fail_job_cache_create:
+    kmem_cache_destroy(crcdev_file_cache);
+fail_cache_create:
+    crcdev_debugfs_exit();
+    return result;
+}
+
+/* */
+static int crcdev_open(struct inode *inode, struct file *filp)
+{
+    struct crc_device *crcdev;
+    struct file_priv_data *priv_data;
+
+    /* Get device associated with current file. Removed devices are not in
+       crc_devices, so new requests are not handled. */
+    rcu_read_lock();
+    crcdev = (struct crc_device *) idr_find(&crc_devices, iminor(inode));
+    if (crcdev == NULL)
+    {   
+        rcu_read_unlock();
+        return -ENXIO;
+    }
+    atomic_inc(&crcdev->open_files);
+    rcu_read_unlock();
+
+    /* Create file's private data (with context). */
+    priv_data = (struct file_priv_data *)
+        kmem_cache_zalloc(crcdev_file_cache, GFP_KERNEL);
+    if (priv_data == NULL)
+    {
+        crcdev_put_file(crcdev);
+        return -ENOMEM;
+    }
+    /* Initialize file's private data. */
+    priv_data->ctx = &priv_data->context;
+    priv_data->crcdev = crcdev;
+    filp->private_data = priv_data;
+    sema_init(&priv_data->sem_file, 1);
+    seqcount_init(&priv_data->seq);
+    spin_lock_init(&priv_data->async_lock);
+    init_waitqueue_head(&priv_data->async_wait);
+    idr_init(&priv_data->streams);
+    priv_data->group = crcdev_get_group();
+    priv_data->pid = task_tgid_nr(current);
+    get_task_comm(priv_data->comm, current);
+    down(&crcdev_files_lock);
+    list_add_tail(&priv_data->files, &crcdev_files);
+    up(&crcdev_files_lock);
+    priv_data->trace_id = atomic_inc_return(&trace_files);
+    crcdev_trace(priv_data, CRCDEV_TRACE_OPEN, 0, 0);
+    return 0;
+}
+
+/* */
+static int crcdev_release(struct inode *inode, struct file *filp)
+{
+    struct file_priv_data *priv_data;
+    struct crc_device *crcdev;
+
+    priv_data = (struct file_priv_data *) filp->private_data;
+    crcdev = (struct crc_device *) priv_data->crcdev;
+    crcdev_trace(priv_data, CRCDEV_TRACE_RELEASE, 0, 0);
+    down(&crcdev_files_lock);
+    list_del(&priv_data->files);
+    up(&crcdev_files_lock);
+    /* Asynchronous jobs use file's registered buffers. They are cancelled
+       (running ones after their current transfer), taking async_lock makes
+       sure the last job no longer touches the file. A stalled ring is reset
+       by the coalescing timer, so the wait ends. */
+    ACCESS_ONCE(priv_data->closing) = 1;
+    wait_event(priv_data->async_wait, priv_data->async_inflight == 0);
+    spin_lock_irq(&priv_data->async_lock);
+    spin_unlock_irq(&priv_data->async_lock);
+    kfree(priv_data->cq);
+    /* Buffered data is dropped, nobody can read the result anymore. */
+    kfree(priv_data->buffer);
+    crcdev_free_fixed_buffers(priv_data);
+    crcdev_free_streams(priv_data);
+    crcdev_put_group(priv_data->group);
+    kmem_cache_free(crcdev_file_cache, priv_data);
+    crcdev_put_file(crcdev);
+    return 0;
+}
+
+/* Takes a context for the next transfer of req, once its group may submit.
+   Contexts are given back after every transfer, so that groups get them by
+   weight; the context is loaded with req's state. Returns 0 or
+   -ERESTARTSYS. */
+static int crcdev_get_transfer_context(struct crc_device *crcdev,
+                                       struct crc_request *req,
+                                       int interruptible)
+{
+    ktime_t start;
+    int result;
+
+    result = crcdev_throttle(req->group, interruptible);
+    if (result)
+        return result;
+    start = ktime_get();
+    result = get_context(crcdev, req->group, interruptible);
+    if (req->usage != NULL)
+        crcdev_usage_add(&req->usage->ctx_wait_ns, start);
+    if (result < 0)
+        return result;
+    req->ctx_no = result;
+    req->load = 1;
+    return 0;
+}
+
+/* Takes a context and its DMA buffer for the next transfer of a write. */
+static int crcdev_get_write_context(struct file_priv_data *priv_data,
+                                    struct crc_request *req)
+{
+    struct crc_device *crcdev = priv_data->crcdev;
+    int result;
+
+    result = crcdev_get_transfer_context(crcdev, req, 1);
+    if (result)
+        return result;
+    if (crcdev_alloc_dma_buffer(crcdev, req->ctx_no))
+    {
+        put_context(crcdev, req->ctx_no);
+        return -ENOMEM;
+    }
+    req->addr = crcdev->dma_handle[req->ctx_no];
+    return 0;
+}
+
+/* Prepares request of a write with file's context and starts publishing
+   its progress. Must be called with sem_file held. */
+static void crcdev_start_write(struct file_priv_data *priv_data,
+                               struct crc_request *req)
+{
+    struct crc_context *ctx = priv_data->ctx;
+
+    req->group = priv_data->group;
+    req->usage = &priv_data->usage;
+    req->poly = ctx->poly;
+    req->sum = ctx->sum;
+
+    write_seqcount_begin(&priv_data->seq);
+    priv_data->writing = 1;
+    priv_data->progress_bytes = 0;
+    priv_data->progress_sum = ctx->sum;
+    write_seqcount_end(&priv_data->seq);
+}
+
+/* Waits for a submitted request, at most request_timeout. Interruptible
+   waits end also on a signal. A request not done then is withdrawn and its
+   context has to be loaded again. Returns 0, -ERESTARTSYS or -ETIMEDOUT. */
+static int crcdev_wait_request(struct crc_device *crcdev,
+                               struct crc_request *req, int interruptible)
+{
+    long timeout = request_timeout ? msecs_to_jiffies(request_timeout) :
+        MAX_SCHEDULE_TIMEOUT;
+    long left;
+    int result = 0;
+
+    if (interruptible)
+        left = wait_for_completion_interruptible_timeout(&req->done, timeout);
+    else
+        left = wait_for_completion_timeout(&req->done, timeout);
+    if (left == 0)
+    {
+        crcdev_check_stall(crcdev);
+        result = crcdev_cancel_request(crcdev, req, -ETIMEDOUT);
+    }
+    else if (left < 0)
+        result = crcdev_cancel_request(crcdev, req, -ERESTARTSYS);
+    else
+        result = req->result;
+    req->load = result != 0;
+    return result;
+}
+
+/* Passes request to dispatcher and waits for computation completion. */
+static int crcdev_transfer(struct crc_device *crcdev, struct crc_request *req,
+                           int interruptible)
+{
+    crcdev_submit(crcdev, req);
+    return crcdev_wait_request(crcdev, req, interruptible);
+}
+
+/* Processes request of a write, gives its context back and publishes
+   file's progress. */
+static int crcdev_process(struct file_priv_data *priv_data,
+                          struct crc_request *req)
+{
+    int result = crcdev_transfer(priv_data->crcdev, req, 1);
+
+    put_context(priv_data->crcdev, req->ctx_no);
+    if (result)
+        return result;
+    write_seqcount_begin(&priv_data->seq);
+    priv_data->progress_bytes += req->count;
+    priv_data->progress_sum = req->sum;
+    write_seqcount_end(&priv_data->seq);
+    return 0;
+}
+
+/* Publishes file's sum (of data processed so far) and number of buffered
+   bytes. */
+static void crcdev_finish_write(struct file_priv_data *priv_data,
+                                struct crc_request *req, size_t buffered)
+{
+    write_seqcount_begin(&priv_data->seq);
+    priv_data->ctx->sum = req->sum;
+    priv_data->buffered = buffered;
+    priv_data->writing = 0;
+    write_seqcount_end(&priv_data->seq);
+}
+
+/* Writes data to file's current context. Must be called with sem_file
+   held. */
+static ssize_t crcdev_write_locked(struct file_priv_data *priv_data,
+                                   const char __user *buff, size_t count)
+{
+    struct crc_device *crcdev = priv_data->crcdev;
+    struct crc_request req;
+    size_t sent = 0, to_send, buffered;
+    char *dma_buffer;
+    ktime_t start;
+    int result;
+    int local;
+
+    /* Count writes issued from outside the device's node. */
+    local = crcdev_cpu_is_local(crcdev);
+    if (local)
+        atomic64_inc(&crcdev->stats.write_local);
+    else
+        atomic64_inc(&crcdev->stats.write_remote);
+
+    /* Buffer for small writes. If it can't be allocated, data is sent
+       directly. */
+    if (priv_data->buffer == NULL)
+        priv_data->buffer = kmalloc(BUFFER_SIZE, GFP_KERNEL);
+
+    /* Small writes are gathered in file's buffer and sent to the device
+       when it gets full (or when the result is needed). */
+    if (priv_data->buffer != NULL &&
+            priv_data->buffered + count < BUFFER_SIZE)
+    {
+        if (copy_from_user(priv_data->buffer + priv_data->buffered, buff,
+                    count))
+        {
+            return -EFAULT;
+        }
+        write_seqcount_begin(&priv_data->seq);
+        priv_data->buffered += count;
+        write_seqcount_end(&priv_data->seq);
+        return count;
+    }
+
+    /* Buffered data goes first. File's sum and buffered are published only
+       when the whole write is done. */
+    crcdev_start_write(priv_data, &req);
+    buffered = priv_data->buffered;
+    result = 0;
+    while (sent < count)
+    {
+        to_send = min_t(size_t, BUFFER_SIZE - buffered, count - sent);
+        /* Keep the tail which doesn't fill the whole buffer. */
+        if (priv_data->buffer != NULL && buffered + to_send < BUFFER_SIZE)
+            break;
+
+        /* Try to get a free device's context. */
+        result = crcdev_get_write_context(priv_data, &req);
+        if (result)
+            break;
+        dma_buffer = crcdev->dma_buffer[req.ctx_no];
+
+        /* Copy user data to DMA buffer. */
+        start = ktime_get();
+        if(copy_from_user(dma_buffer + buffered, buff + sent, to_send))
+        { 
+            printk(KERN_ERR "copy_to_user failed!\n");
+            put_context(crcdev, req.ctx_no);
+            result = -EFAULT;
+            break;
+        }
+        if (buffered)
+            memcpy(dma_buffer, priv_data->buffer, buffered);
+        crcdev_sync_dma_buffer(crcdev, req.ctx_no, buffered + to_send);
+        crcdev_usage_add(&priv_data->usage.copy_ns, start);
+        if (!local)
+            atomic64_add(buffered + to_send, &crcdev->stats.bytes_remote);
+
+        /* Data of a failed transfer stays unsent, buffered data stays in
+           file's buffer. */
+        req.count = buffered + to_send;
+        result = crcdev_process(priv_data, &req);
+        if (result)
+            break;
+        buffered = 0;
+        sent += to_send;
+    }
+
+    /* Buffer the tail. */
+    if (result == 0 && sent < count)
+    {
+        if (copy_from_user(priv_data->buffer + buffered, buff + sent,
+                    count - sent))
+            result = -EFAULT;
+        else
+        {
+            buffered += count - sent;
+            sent = count;
+        }
+    }
+
+    /* Copy final values. */
+    crcdev_finish_write(priv_data, &req, buffered);
+    return sent ? sent : result;
+}
+
+/* */
+static ssize_t crcdev_write(struct file *filp, const char __user *buff,
+                            size_t count, loff_t *offp)
+{
+    struct file_priv_data *priv_data;
+    ssize_t result;
+
+    priv_data = (struct file_priv_data *) filp->private_data;
+    crcdev_trace(priv_data, CRCDEV_TRACE_WRITE, 0, count);
+
+    /* Only one thread can "work" with file at the same time. */
+    if (down_interruptible(&priv_data->sem_file))
+    {
+        return -ERESTARTSYS;
+    }
+    result = crcdev_write_locked(priv_data, buff, count);
+    up(&priv_data->sem_file);
+    return result;
+}
+
+/* Sends data gathered in file's buffer to the device. Must be called with
+   sem_file held. */
+static int crcdev_flush_buffer(struct file_priv_data *priv_data)
+{
+    struct crc_device *crcdev = priv_data->crcdev;
+    struct crc_request req;
+    ktime_t start;
+    int result;
+
+    if (priv_data->buffered == 0)
+        return 0;
+    crcdev_start_write(priv_data, &req);
+    result = crcdev_get_write_context(priv_data, &req);
+    if (result)
+    {
+        crcdev_finish_write(priv_data, &req, priv_data->buffered);
+        return result;
+    }
+    req.count = priv_data->buffered;
+    start = ktime_get();
+    memcpy(crcdev->dma_buffer[req.ctx_no], priv_data->buffer, req.count);
+    crcdev_sync_dma_buffer(crcdev, req.ctx_no, req.count);
+    crcdev_usage_add(&priv_data->usage.copy_ns, start);
+    if (!crcdev_cpu_is_local(crcdev))
+        atomic64_add(req.count, &crcdev->stats.bytes_remote);
+
+    result = crcdev_process(priv_data, &req);
+    crcdev_finish_write(priv_data, &req, result ? req.count : 0);
+    return result;
+}
+
+/* Finds file's stream, 0 is the context the file was opened with. Must be
+   called with sem_file held. */
+static struct crc_context *crcdev_find_stream(struct file_priv_data *priv_data,
+                                              u32 id)
+{
+    struct crc_stream *stream;
+
+    if (id == 0)
+        return &priv_data->context;
+    stream = (struct crc_stream *) idr_find(&priv_data->streams, id);
+    return stream != NULL ? &stream->context : NULL;
+}
+
+/* Makes ctx the file's current context. Buffered data belongs to the
+   previous one, so it is sent first. Must be called with sem_file held. */
+static int crcdev_switch_context(struct file_priv_data *priv_data,
+                                 struct crc_context *ctx)
+{
+    int result;
+
+    if (ctx == priv_data->ctx)
+        return 0;
+    result = crcdev_flush_buffer(priv_data);
+    if (result)
+        return result;
+    write_seqcount_begin(&priv_data->seq);
+    priv_data->ctx = ctx;
+    write_seqcount_end(&priv_data->seq);
+    return 0;
+}
+
+/* Creates a stream with its own context. Must be called with sem_file
+   held. */
+static int crcdev_create_stream(struct file_priv_data *priv_data,
+                                struct crcdev_ioctl_stream *params)
+{
+    struct crc_stream *stream;
+    int id, result;
+
+    if (priv_data->nr_streams >= MAX_STREAMS)
+        return -ENOSPC;
+    stream = (struct crc_stream *) kmalloc(sizeof(struct crc_stream),
+            GFP_KERNEL);
+    if (stream == NULL)
+        return -ENOMEM;
+    stream->context.poly = params->poly;
+    stream->context.sum = params->sum;
+    do
+    {
+        if (!idr_pre_get(&priv_data->streams, GFP_KERNEL))
+        {
+            kfree(stream);
+            return -ENOMEM;
+        }
+        result = idr_get_new_above(&priv_data->streams, stream, 1, &id);
+    } while (result == -EAGAIN);
+    if (result)
+    {
+        kfree(stream);
+        return result;
+    }
+    priv_data->nr_streams++;
+    params->id = id;
+    return 0;
+}
+
+/* Creates a new stream with the state of stream params->id, including data
+   buffered for it. Must be called with sem_file held. */
+static int crcdev_clone_stream(struct file_priv_data *priv_data,
+                               struct crcdev_ioctl_stream *params)
+{
+    struct crc_context *ctx;
+    int result;
+
+    ctx = crcdev_find_stream(priv_data, params->id);
+    if (ctx == NULL)
+        return -EINVAL;
+    /* Only the current stream may have buffered data. */
+    if (ctx == priv_data->ctx)
+    {
+        result = crcdev_flush_buffer(priv_data);
+        if (result)
+            return result;
+    }
+    params->poly = ctx->poly;
+    params->sum = ctx->sum;
+    return crcdev_create_stream(priv_data, params);
+}
+
+/* Destroys a stream. If it is the current one, the file goes back to stream
+   0 and the stream's buffered data is dropped. Must be called with sem_file
+   held. */
+static int crcdev_destroy_stream(struct file_priv_data *priv_data, u32 id)
+{
+    struct crc_stream *stream;
+
+    if (id == 0)
+        return -EINVAL;
+    stream = (struct crc_stream *) idr_find(&priv_data->streams, id);
+    if (stream == NULL)
+        return -EINVAL;
+    idr_remove(&priv_data->streams, id);
+    priv_data->nr_streams--;
+    if (priv_data->ctx == &stream->context)
+    {
+        write_seqcount_begin(&priv_data->seq);
+        priv_data->ctx = &priv_data->context;
+        priv_data->buffered = 0;
+        write_seqcount_end(&priv_data->seq);
+    }
+    /* GET_RESULT may still read the context without sem_file. */
+    kfree_rcu(stream, rcu);
+    return 0;
+}
+
+static int crcdev_free_stream(int id, void *p, void *data)
+{
+    kfree(p);
+    return 0;
+}
+
+/* Frees all streams of a file being released. */
+static void crcdev_free_streams(struct file_priv_data *priv_data)
+{
+    idr_for_each(&priv_data->streams, crcdev_free_stream, NULL);
+    idr_remove_all(&priv_data->streams);
+    idr_destroy(&priv_data->streams);
+}
+
+/* Charges pages of a registered buffer to the current process's pinned
+   memory, which RLIMIT_MEMLOCK limits (unless the process has
+   CAP_IPC_LOCK). */
+static int crcdev_charge_pinned(struct crc_fixed_buffer *fixed)
+{
+    struct mm_struct *mm = current->mm;
+    unsigned long limit = rlimit(RLIMIT_MEMLOCK) >> PAGE_SHIFT;
+    int result = 0;
+
+    down_write(&mm->mmap_sem);
+    if (mm->pinned_vm + fixed->nr_pages > limit && !capable(CAP_IPC_LOCK))
+        result = -ENOMEM;
+    else
+    {
+        mm->pinned_vm += fixed->nr_pages;
+        /* The buffer may outlive the process (e.g. a file passed on). */
+        atomic_inc(&mm->mm_count);
+        fixed->mm = mm;
+    }
+    up_write(&mm->mmap_sem);
+    return result;
+}
+
+/* Releases pages and DMA mapping of a registered buffer. */
+static void crcdev_free_fixed_buffer(struct crc_device *crcdev,
+                                     struct crc_fixed_buffer *fixed)
+{
+    int i;
+
+    if (fixed->nents > 0)
+        dma_unmap_sg(&crcdev->pcidev->dev, fixed->sgl, fixed->nr_sg,
+                DMA_TO_DEVICE);
+    for (i = 0; i < fixed->nr_pinned; ++i)
+        put_page(fixed->pages[i]);
+    if (fixed->mm != NULL)
+    {
+        down_write(&fixed->mm->mmap_sem);
+        fixed->mm->pinned_vm -= fixed->nr_pages;
+        up_write(&fixed->mm->mmap_sem);
+        mmdrop(fixed->mm);
+    }
+    vfree(fixed->sgl);
+    vfree(fixed->pages);
+    kfree(fixed);
+}
+
+/* Releases all buffers registered by a file. */
+static void crcdev_free_fixed_buffers(struct file_priv_data *priv_data)
+{
+    int i;
+
+    for (i = 0; i < MAX_FIXED_BUFFERS; ++i)
+        if (priv_data->fixed[i] != NULL)
+            crcdev_free_fixed_buffer(priv_data->crcdev, priv_data->fixed[i]);
+}
+
+/* Pins user's buffer and maps it for DMA once, so that later writes from it
+   need neither copying nor mapping. Physically contiguous pages (e.g. of
+   huge pages) are merged into one segment, within the device's segment size
+   and boundary. Must be called with sem_file held. */
+static int crcdev_register_buffer(struct file_priv_data *priv_data,
+                                  unsigned long addr, size_t len, u32 *id)
+{
+    struct crc_device *crcdev = priv_data->crcdev;
+    struct crc_fixed_buffer *fixed;
+    struct device *dev = &crcdev->pcidev->dev;
+    struct scatterlist *sg = NULL;
+    unsigned long offset, boundary = dma_get_seg_boundary(dev);
+    unsigned int max_seg = dma_get_max_seg_size(dev);
+    phys_addr_t start, end;
+    size_t seg_len;
+    int slot, i, pinned;
+    int result = 0;
+
+    if (len == 0 || len > FIXED_BUFFER_MAX_SIZE || addr + len < addr)
+        return -EINVAL;
+    for (slot = 0; slot < MAX_FIXED_BUFFERS; ++slot)
+        if (priv_data->fixed[slot] == NULL)
+            break;
+    if (slot == MAX_FIXED_BUFFERS)
+        return -ENOSPC;
+
+    fixed = (struct crc_fixed_buffer *)
+        kzalloc(sizeof(struct crc_fixed_buffer), GFP_KERNEL);
+    if (fixed == NULL)
+        return -ENOMEM;
+    fixed->len = len;
+    fixed->nr_pages = ((addr + len - 1) >> PAGE_SHIFT) - (addr >> PAGE_SHIFT)
+        + 1;
+    fixed->pages = vmalloc(fixed->nr_pages * sizeof(struct page *));
+    fixed->sgl = vmalloc(fixed->nr_pages * sizeof(struct scatterlist));
+    if (fixed->pages == NULL || fixed->sgl == NULL)
+    {
+        result = -ENOMEM;
+        goto fail;
+    }
+
+    result = crcdev_charge_pinned(fixed);
+    if (result)
+        goto fail;
+    pinned = get_user_pages_fast(addr, fixed->nr_pages, 0, fixed->pages);
+    if (pinned > 0)
+        fixed->nr_pinned = pinned;
+    if (pinned != fixed->nr_pages)
+    {
+        result = pinned < 0 ? pinned : -EFAULT;
+        goto fail;
+    }
+
+    sg_init_table(fixed->sgl, fixed->nr_pages);
+    offset = offset_in_page(addr);
+    for (i = 0; i < fixed->nr_pages; ++i)
+    {
+        seg_len = min_t(size_t, PAGE_SIZE - offset, len);
+        if (sg != NULL)
+        {
+            start = sg_phys(sg);
+            end = start + sg->length + seg_len - 1;
+        }
+        if (sg != NULL && page_to_pfn(fixed->pages[i]) ==
+                page_to_pfn(fixed->pages[i - 1]) + 1 &&
+                sg->length + seg_len <= max_seg &&
+                (start | boundary) == (end | boundary))
+        {
+            sg->length += seg_len;
+        }
+        else
+        {
+            sg = (sg == NULL) ? fixed->sgl : sg_next(sg);
+            sg_set_page(sg, fixed->pages[i], seg_len, offset);
+            fixed->nr_sg++;
+        }
+        len -= seg_len;
+        offset = 0;
+    }
+    sg_mark_end(sg);
+
+    fixed->nents = dma_map_sg(dev, fixed->sgl, fixed->nr_sg, DMA_TO_DEVICE);
+    if (fixed->nents == 0)
+    {
+        dev_err(dev, "dma_map_sg failed.\n");
+        result = -ENOMEM;
+        goto fail;
+    }
+
+    priv_data->fixed[slot] = fixed;
+    atomic64_add(fixed->len, &priv_data->usage.pinned);
+    *id = slot;
+    return 0;
+
+fail:
+    crcdev_free_fixed_buffer(crcdev, fixed);
+    return result;
+}
+
+/* Frees a registered buffer of a file. Must be called with sem_file held. */
+static void crcdev_unregister_buffer(struct file_priv_data *priv_data, u32 id)
+{
+    atomic64_sub(priv_data->fixed[id]->len, &priv_data->usage.pinned);
+    crcdev_free_fixed_buffer(priv_data->crcdev, priv_data->fixed[id]);
+    priv_data->fixed[id] = NULL;
+}
+
+/* Sends len bytes at offset of registered buffer, each transfer through a
+   context taken for it, and publishes file's progress. Long segments are
+   split, so that other clients are not stalled for too long. The user may
+   have changed the buffer since the last request, so it is synced for the
+   device first. */
+static int crcdev_process_fixed(struct file_priv_data *priv_data,
+                                struct crc_request *req,
+                                struct crc_fixed_buffer *fixed,
+                                u64 offset, u64 len)
+{
+    struct crc_device *crcdev = priv_data->crcdev;
+    struct scatterlist *sg;
+    size_t seg_len;
+    int i, result;
+
+    dma_sync_sg_for_device(&crcdev->pcidev->dev, fixed->sgl, fixed->nr_sg,
+            DMA_TO_DEVICE);
+    for_each_sg(fixed->sgl, sg, fixed->nents, i)
+    {
+        seg_len = sg_dma_len(sg);
+        if (offset >= seg_len)
+        {
+            offset -= seg_len;
+            continue;
+        }
+        while (offset < seg_len && len > 0)
+        {
+            result = crcdev_get_transfer_context(crcdev, req, 1);
+            if (result)
+                return result;
+            req->addr = sg_dma_address(sg) + offset;
+            req->count = min_t(u64, min_t(u64, seg_len - offset, len),
+                    CRCDEV_MAX_TRANSFER_SIZE);
+            result = crcdev_process(priv_data, req);
+            if (result)
+                return result;
+            offset += req->count;
+            len -= req->count;
+        }
+        if (len == 0)
+            break;
+        offset = 0;
+    }
+    return 0;
+}
+
+/* Computes CRC of a part of registered buffer. Transfers go directly from
+   user's pages. Must be called with sem_file held. */
+static int crcdev_write_fixed(struct file_priv_data *priv_data,
+                              struct crcdev_ioctl_write_fixed *params)
+{
+    struct crc_fixed_buffer *fixed;
+    struct crc_request req;
+    u64 offset = params->offset;
+    u64 len = params->len;
+    u32 sum;
+    int result;
+
+    if (params->id >= MAX_FIXED_BUFFERS ||
+            priv_data->fixed[params->id] == NULL)
+        return -EINVAL;
+    fixed = priv_data->fixed[params->id];
+    if (offset > fixed->len || len > fixed->len - offset)
+        return -EINVAL;
+
+    /* Data written earlier goes first. */
+    result = crcdev_flush_buffer(priv_data);
+    if (result || len == 0)
+        return result;
+    crcdev_start_write(priv_data, &req);
+    /* A failed write leaves file's sum as it was. */
+    sum = req.sum;
+    result = crcdev_process_fixed(priv_data, &req, fixed, offset, len);
+    if (result)
+        req.sum = sum;
+    crcdev_finish_write(priv_data, &req, 0);
+    return result;
+}
+
+/* Copies the next part of slot's block to its DMA buffer and submits it. */
+static int crcdev_block_send(struct crc_device *crcdev,
+                             struct crc_block_slot *slot)
+{
+    ktime_t start = ktime_get();
+
+    slot->req.addr = crcdev->dma_handle[slot->req.ctx_no];
+    slot->req.count = min_t(u64, slot->size - slot->done, BUFFER_SIZE);
+    if (copy_from_user(crcdev->dma_buffer[slot->req.ctx_no],
+                slot->data + slot->done, slot->req.count))
+        return -EFAULT;
+    crcdev_sync_dma_buffer(crcdev, slot->req.ctx_no, slot->req.count);
+    crcdev_usage_add(&slot->req.usage->copy_ns, start);
+    crcdev_submit(crcdev, &slot->req);
+    slot->active = 1;
+    return 0;
+}
+
+/* Starts summing a block of BLOCK_CRC on slot's context. */
+static int crcdev_block_start(struct crc_device *crcdev,
+                              struct crc_block_slot *slot,
+                              struct crcdev_ioctl_block_crc *params,
+                              u64 block, int index)
+{
+    u64 offset = block * params->block_size;
+
+    slot->data = (const char __user *) (unsigned long) (params->buf + offset);
+    slot->size = min_t(u64, params->len - offset, params->block_size);
+    slot->done = 0;
+    slot->index = index;
+    slot->req.load = 1;
+    slot->req.poly = params->poly;
+    slot->req.sum = params->sum;
+    return crcdev_block_send(crcdev, slot);
+}
+
+/* Sums count blocks starting at first. Every slot works on its own block,
+   so the device sums one while the next ones are copied. After a failure
+   (a fault, a signal or a timeout) transfers in flight are withdrawn. */
+static int crcdev_block_batch(struct crc_device *crcdev,
+                              struct crc_block_slot *slots, int nr_slots,
+                              struct crcdev_ioctl_block_crc *params,
+                              u64 first, int count, u32 *sums)
+{
+    struct crc_block_slot *slot;
+    int next = 0, active = 0, result = 0;
+    int s;
+
+    for (s = 0; s < nr_slots; ++s)
+    {
+        slots[s].active = 0;
+        if (result == 0 && next < count)
+        {
+            result = crcdev_block_start(crcdev, &slots[s], params,
+                    first + next, next);
+            next++;
+        }
+        if (slots[s].active)
+            active++;
+    }
+
+    /* Contexts are waited for in turn. */
+    for (s = 0; active > 0; s = (s + 1) % nr_slots)
+    {
+        slot = &slots[s];
+        if (!slot->active)
+            continue;
+        slot->active = 0;
+        if (result == 0)
+            result = crcdev_wait_request(crcdev, &slot->req, 1);
+        else
+            crcdev_cancel_request(crcdev, &slot->req, result);
+        if (result == 0)
+        {
+            slot->done += slot->req.count;
+            if (slot->done < slot->size)
+                result = crcdev_block_send(crcdev, slot);
+            else
+            {
+                sums[slot->index] = slot->req.sum;
+                if (next < count)
+                {
+                    result = crcdev_block_start(crcdev, slot, params,
+                            first + next, next);
+                    next++;
+                }
+            }
+        }
+        if (!slot->active)
+            active--;
+    }
+    return result;
+}
+
+/* Gives back contexts taken by crcdev_block_get_slots. */
+static void crcdev_block_put_slots(struct crc_device *crcdev,
+                                   struct crc_block_slot *slots, int nr_slots)
+{
+    int s;
+
+    for (s = 0; s < nr_slots; ++s)
+        put_context(crcdev, slots[s].req.ctx_no);
+}
+
+/* Takes contexts for a batch of count blocks, once file's group may submit:
+   one is waited for, others are taken only if free. Contexts are given back
+   after every batch, so that other groups get them by weight. Returns the
+   number of slots or -ERESTARTSYS, -ENOMEM. */
+static int crcdev_block_get_slots(struct file_priv_data *priv_data,
+                                  struct crc_block_slot *slots, int count)
+{
+    struct crc_device *crcdev = priv_data->crcdev;
+    ktime_t start;
+    int nr_slots, s, result;
+
+    if (crcdev_throttle(priv_data->group, 1))
+        return -ERESTARTSYS;
+    start = ktime_get();
+    result = get_context(crcdev, priv_data->group, 1);
+    crcdev_usage_add(&priv_data->usage.ctx_wait_ns, start);
+    if (result < 0)
+        return result;
+    slots[0].req.ctx_no = result;
+    nr_slots = 1;
+    while (nr_slots < CRCDEV_CTX_COUNT && nr_slots < count)
+    {
+        slots[nr_slots].req.ctx_no = try_get_context(crcdev,
+                priv_data->group);
+        if (slots[nr_slots].req.ctx_no < 0)
+            break;
+        nr_slots++;
+    }
+    result = 0;
+    for (s = 0; s < nr_slots; ++s)
+    {
+        slots[s].req.group = priv_data->group;
+        slots[s].req.usage = &priv_data->usage;
+        if (result == 0)
+            result = crcdev_alloc_dma_buffer(crcdev, slots[s].req.ctx_no);
+    }
+    if (result)
+    {
+        crcdev_block_put_slots(crcdev, slots, nr_slots);
+        return result;
+    }
+    return nr_slots;
+}
+
+/* BLOCK_CRC and BLOCK_VERIFY. Each batch uses all free contexts (at least
+   one) and doesn't touch file's state. Returns number of mismatched blocks for
+   verify. */
+static int crcdev_block_crc(struct file_priv_data *priv_data,
+                            struct crcdev_ioctl_block_crc *params, int verify)
+{
+    struct crc_device *crcdev = priv_data->crcdev;
+    struct crc_block_slot slots[CRCDEV_CTX_COUNT];
+    u32 __user *user_sums = (u32 __user *) (unsigned long) params->sums;
+    u8 __user *user_bitmap = (u8 __user *) (unsigned long) params->bitmap;
+    u8 bitmap[BLOCK_BATCH / 8];
+    u32 *sums, *expected;
+    u64 nr_blocks, first;
+    u32 rem;
+    int nr_slots, count, i;
+    int mismatches = 0, result = 0;
+
+    if (params->block_size == 0 || params->len == 0)
+        return -EINVAL;
+    nr_blocks = div_u64_rem(params->len, params->block_size, &rem);
+    if (rem)
+        nr_blocks++;
+    if (nr_blocks > INT_MAX)
+        return -EINVAL;
+
+    sums = (u32 *) kmalloc(2 * BLOCK_BATCH * sizeof(u32), GFP_KERNEL);
+    if (sums == NULL)
+        return -ENOMEM;
+    expected = sums + BLOCK_BATCH;
+
+    for (first = 0; result == 0 && first < nr_blocks; first += count)
+    {
+        count = min_t(u64, nr_blocks - first, BLOCK_BATCH);
+        nr_slots = crcdev_block_get_slots(priv_data, slots, count);
+        if (nr_slots < 0)
+        {
+            result = nr_slots;
+            break;
+        }
+        result = crcdev_block_batch(crcdev, slots, nr_slots, params, first,
+                count, sums);
+        crcdev_block_put_slots(crcdev, slots, nr_slots);
+        if (result)
+            break;
+        if (!verify)
+        {
+            if (copy_to_user(user_sums + first, sums, count * sizeof(u32)))
+                result = -EFAULT;
+            continue;
+        }
+        if (copy_from_user(expected, user_sums + first, count * sizeof(u32)))
+        {
+            result = -EFAULT;
+            break;
+        }
+        memset(bitmap, 0, sizeof(bitmap));
+        for (i = 0; i < count; ++i)
+            if (sums[i] != expected[i])
+            {
+                bitmap[i / 8] |= 1 << (i % 8);
+                mismatches++;
+            }
+        if (copy_to_user(user_bitmap + first / 8, bitmap,
+                    DIV_ROUND_UP(count, 8)))
+            result = -EFAULT;
+    }
+
+    kfree(sums);
+    return result ? result : mismatches;
+}
+
+/* Posts completion of an asynchronous job and frees it. */
+static void crcdev_async_post(struct crc_async_job *job, int result)
+{
+    struct file_priv_data *priv_data = job->priv_data;
+    struct crcdev_ioctl_cqe *cqe;
+    unsigned long flags;
+
+    spin_lock_irqsave(&priv_data->async_lock, flags);
+    cqe = &priv_data->cq[priv_data->cq_tail % CRCDEV_ASYNC_DEPTH];
+    cqe->user_data = job->user_data;
+    cqe->sum = job->req.sum;
+    cqe->result = result;
+    priv_data->cq_tail++;
+    priv_data->async_inflight--;
+    wake_up(&priv_data->async_wait);
+    spin_unlock_irqrestore(&priv_data->async_lock, flags);
+    kmem_cache_free(crcdev_job_cache, job);
+}
+
+/* Queues the next transfer of a job through the context it was given.
+   Long segments are split, as for synchronous writes. Must be called with
+   regs_lock held. */
+static void crcdev_async_granted(struct crc_device *crcdev,
+                                 struct crc_ctx_waiter *waiter)
+{
+    struct crc_async_job *job =
+        container_of(waiter, struct crc_async_job, waiter);
+    struct crc_request *req = &job->req;
+
+    crcdev_usage_add(&req->usage->ctx_wait_ns, job->wait_start);
+    req->ctx_no = waiter->ctx_no;
+    req->load = 1;
+    req->addr = sg_dma_address(job->sg) + job->offset;
+    req->count = min_t(u64, min_t(u64, sg_dma_len(job->sg) - job->offset,
+                job->len), CRCDEV_MAX_TRANSFER_SIZE);
+    req->submitted = ktime_get();
+    req->cancelled = 0;
+    req->result = 0;
+    req->state = REQ_READY;
+    list_add_tail(&req->list, &crcdev->ready);
+}
+
+/* Waits for a context for the next transfer of a job, or posts its
+   completion once it is done, failed or its file is being closed. Groups
+   over their rate limit wait in delayed work. Must be called with regs_lock
+   held, the caller starts queued requests. */
+static void crcdev_async_next(struct crc_device *crcdev,
+                              struct crc_async_job *job, int result)
+{
+    long delay;
+    int i;
+
+    if (result == 0 && ACCESS_ONCE(job->priv_data->closing))
+        result = -ECANCELED;
+    if (result || job->len == 0)
+    {
+        crcdev_async_post(job, result);
+        return;
+    }
+    job->wait_start = ktime_get();
+    delay = crcdev_throttle_delay(job->req.group);
+    if (delay)
+    {
+        queue_delayed_work(crcdev_wq, &job->work, delay);
+        return;
+    }
+
+    crcdev_group_catch_up(job->req.group);
+    if (list_empty(&crcdev->ctx_waiters))
+        for (i = 0; i < CRCDEV_CTX_COUNT; ++i)
+            if (!test_and_set_bit(i, &crcdev->ctx_busy))
+            {
+                crcdev_grant_context(job->req.group);
+                job->waiter.ctx_no = i;
+                crcdev_async_granted(crcdev, &job->waiter);
+                return;
+            }
+    job->waiter.ctx_no = -1;
+    list_add_tail(&job->waiter.list, &crcdev->ctx_waiters);
+}
+
+/* Called when a transfer of a job is done: gives its context back (to the
+   next waiter) and moves on to the next transfer. Must be called with
+   regs_lock held. */
+static void crcdev_async_done(struct crc_device *crcdev,
+                              struct crc_request *req)
+{
+    struct crc_async_job *job = container_of(req, struct crc_async_job, req);
+
+    put_context_locked(crcdev, req->ctx_no);
+    if (req->result == 0)
+    {
+        job->offset += req->count;
+        job->len -= req->count;
+        if (job->offset == sg_dma_len(job->sg))
+        {
+            job->sg = sg_next(job->sg);
+            job->offset = 0;
+        }
+    }
+    crcdev_async_next(crcdev, job, req->result);
+}
+
+/* Runs a job whose group was over its rate limit. */
+static void crcdev_async_work(struct work_struct *work)
+{
+    struct crc_async_job *job =
+        container_of(to_delayed_work(work), struct crc_async_job, work);
+    struct crc_device *crcdev = job->priv_data->crcdev;
+    unsigned long flags;
+
+    crcdev_usage_add(&job->req.group->throttled_ns, job->wait_start);
+    spin_lock_irqsave(&crcdev->regs_lock, flags);
+    crcdev_async_next(crcdev, job, 0);
+    crcdev_start_requests(crcdev);
+    spin_unlock_irqrestore(&crcdev->regs_lock, flags);
+}
+
+/* Starts an asynchronous job. The user may have changed the registered
+   buffer since the last request, so it is synced for the device first. */
+static void crcdev_async_start(struct crc_device *crcdev,
+                               struct crc_async_job *job)
+{
+    struct crc_fixed_buffer *fixed = job->fixed;
+    unsigned long flags;
+
+    if (job->len)
+    {
+        dma_sync_sg_for_device(&crcdev->pcidev->dev, fixed->sgl,
+                fixed->nr_sg, DMA_TO_DEVICE);
+        for (job->sg = fixed->sgl; job->offset >= sg_dma_len(job->sg);
+                job->sg = sg_next(job->sg))
+            job->offset -= sg_dma_len(job->sg);
+    }
+    spin_lock_irqsave(&crcdev->regs_lock, flags);
+    crcdev_async_next(crcdev, job, 0);
+    crcdev_start_requests(crcdev);
+    spin_unlock_irqrestore(&crcdev->regs_lock, flags);
+}
+
+/* Queues asynchronous requests. Returns number of queued requests, fails
+   only if none was queued. Must be called with sem_file held. */
+static int crcdev_submit_async(struct file_priv_data *priv_data,
+                               struct crcdev_ioctl_submit *params)
+{
+    struct crcdev_ioctl_async_req __user *reqs;
+    struct crcdev_ioctl_async_req areq;
+    struct crc_fixed_buffer *fixed;
+    struct crc_async_job *job;
+    int i, full, result = 0;
+
+    reqs = (struct crcdev_ioctl_async_req __user *)
+        (unsigned long) params->reqs;
+    if (priv_data->cq == NULL)
+    {
+        priv_data->cq = (struct crcdev_ioctl_cqe *) kmalloc(
+                CRCDEV_ASYNC_DEPTH * sizeof(struct crcdev_ioctl_cqe),
+                GFP_KERNEL);
+        if (priv_data->cq == NULL)
+            return -ENOMEM;
+    }
+
+    for (i = 0; i < params->nr; ++i)
+    {
+        if (copy_from_user(&areq, &reqs[i], sizeof(areq)))
+        {
+            result = -EFAULT;
+            break;
+        }
+        if (areq.id >= MAX_FIXED_BUFFERS || priv_data->fixed[areq.id] == NULL)
+        {
+            result = -EINVAL;
+            break;
+        }
+        fixed = priv_data->fixed[areq.id];
+        if (areq.offset > fixed->len || areq.len > fixed->len - areq.offset)
+        {
+            result = -EINVAL;
+            break;
+        }
+        job = (struct crc_async_job *)
+            kmem_cache_alloc(crcdev_job_cache, GFP_KERNEL);
+        if (job == NULL)
+        {
+            result = -ENOMEM;
+            break;
+        }
+        /* Reserve a slot for the completion. */
+        spin_lock_irq(&priv_data->async_lock);
+        full = priv_data->async_inflight + priv_data->cq_tail -
+            priv_data->cq_head >= CRCDEV_ASYNC_DEPTH;
+        if (!full)
+            priv_data->async_inflight++;
+        spin_unlock_irq(&priv_data->async_lock);
+        if (full)
+        {
+            kmem_cache_free(crcdev_job_cache, job);
+            result = -EAGAIN;
+            break;
+        }
+
+        INIT_DELAYED_WORK(&job->work, crcdev_async_work);
+        job->priv_data = priv_data;
+        job->fixed = fixed;
+        job->user_data = areq.user_data;
+        job->offset = areq.offset;
+        job->len = areq.len;
+        job->req.poly = areq.poly;
+        job->req.sum = areq.sum;
+        job->req.group = priv_data->group;
+        job->req.usage = &priv_data->usage;
+        job->req.callback = crcdev_async_done;
+        job->waiter.group = priv_data->group;
+        job->waiter.task = NULL;
+        job->waiter.granted = crcdev_async_granted;
+        crcdev_async_start(priv_data->crcdev, job);
+    }
+    return i ? i : result;
+}
+
+/* Returns number of completions waiting to be reaped. */
+static unsigned int crcdev_cq_ready(struct file_priv_data *priv_data)
+{
+    unsigned int ready;
+
+    spin_lock_irq(&priv_data->async_lock);
+    ready = priv_data->cq_tail - priv_data->cq_head;
+    spin_unlock_irq(&priv_data->async_lock);
+    return ready;
+}
+
+/* Copies completions of asynchronous requests to user, waiting for at least
+   min_complete of them. Returns number of copied completions. */
+static int crcdev_reap(struct file_priv_data *priv_data,
+                       struct crcdev_ioctl_reap *params)
+{
+    struct crcdev_ioctl_cqe __user *cqes;
+    unsigned int nr = min_t(u32, params->nr, CRCDEV_ASYNC_DEPTH);
+    unsigned int min_complete = min_t(u32, params->min_complete, nr);
+    unsigned int ready, i;
+    int result = 0;
+
+    cqes = (struct crcdev_ioctl_cqe __user *) (unsigned long) params->cqes;
+    /* A stalled ring is reset by the coalescing timer, as in release. */
+    if (wait_event_interruptible(priv_data->async_wait,
+                crcdev_cq_ready(priv_data) >= min_complete))
+        return -ERESTARTSYS;
+
+    /* Only reapers move cq_head, entries before cq_tail are not touched by
+       workers. */
+    if (down_interruptible(&priv_data->sem_file))
+        return -ERESTARTSYS;
+    ready = min(crcdev_cq_ready(priv_data), nr);
+    for (i = 0; i < ready; ++i)
+        if (copy_to_user(&cqes[i], &priv_data->cq[(priv_data->cq_head + i) %
+                    CRCDEV_ASYNC_DEPTH], sizeof(struct crcdev_ioctl_cqe)))
+        {
+            result = -EFAULT;
+            break;
+        }
+    spin_lock_irq(&priv_data->async_lock);
+    priv_data->cq_head += i;
+    spin_unlock_irq(&priv_data->async_lock);
+    up(&priv_data->sem_file);
+    return i ? i : result;
+}
+
+/* Reports the file readable when completions can be reaped. */
+static unsigned int crcdev_poll(struct file *filp, poll_table *wait)
+{
+    struct file_priv_data *priv_data;
+
+    priv_data = (struct file_priv_data *) filp->private_data;
+    poll_wait(filp, &priv_data->async_wait, wait);
+    if (crcdev_cq_ready(priv_data))
+        return POLLIN | POLLRDNORM;
+    return 0;
+}
+
+/* Crypto API: "crc32" and "crc32c" ahash algorithms computed by the devices.
+   Short updates (and all updates when there is no device) are computed by
+   the best other (shash) driver of the algorithm, longer ones are mapped for
+   DMA and passed through a hardware context by a worker of crcdev_wq. Users
+   of the shash interface (e.g. libcrc32c) are not served. */
+
+/* Finds a working device and takes a reference (as open does). Devices are
+   used in turn. */
+static struct crc_device *crcdev_get_any(void)
+{
+    static atomic_t next = ATOMIC_INIT(0);
+    struct crc_device *crcdev;
+    int start = atomic_inc_return(&next) % MAX_DEVICES;
+    int id = start;
+
+    rcu_read_lock();
+    crcdev = (struct crc_device *) idr_get_next(&crc_devices, &id);
+    if (crcdev == NULL)
+    {
+        id = 0;
+        crcdev = (struct crc_device *) idr_get_next(&crc_devices, &id);
+    }
+    if (crcdev != NULL)
+        atomic_inc(&crcdev->open_files);
+    rcu_read_unlock();
+    return crcdev;
+}
+
+/* Table of software CRC, one per algorithm. Used only if there is no other
+   driver of the algorithm. */
+static u32 crcdev_hash_table[ARRAY_SIZE(crcdev_hash_params)][256];
+
+static void crcdev_hash_init_tables(void)
+{
+    u32 c;
+    int a, i, k;
+
+    for (a = 0; a < ARRAY_SIZE(crcdev_hash_params); ++a)
+        for (i = 0; i < 256; ++i)
+        {
+            c = i;
+            for (k = 0; k < 8; ++k)
+                c = (c >> 1) ^ (crcdev_hash_params[a].poly & -(c & 1));
+            crcdev_hash_table[a][i] = c;
+        }
+}
+
+/* Computes CRC of the request's data on the CPU, with the fallback driver
+   if there is one. Its state is the CRC before the final xor, as ours. */
+static void crcdev_hash_soft(struct ahash_request *req,
+                             struct crcdev_hash_req_ctx *rctx)
+{
+    struct crcdev_hash_tfm_ctx *tctx =
+        crypto_ahash_ctx(crypto_ahash_reqtfm(req));
+    const u32 *table = crcdev_hash_table[rctx->alg];
+    struct shash_desc *desc = &rctx->fallback;
+    struct sg_mapping_iter miter;
+    unsigned int left = req->nbytes;
+    const u8 *p;
+    size_t len;
+    u32 crc = rctx->crc;
+
+    if (tctx->fallback != NULL)
+    {
+        desc->tfm = tctx->fallback;
+        desc->flags = 0;
+        crypto_shash_import(desc, &crc);
+    }
+    sg_miter_start(&miter, req->src, sg_nents(req->src),
+            SG_MITER_FROM_SG | SG_MITER_ATOMIC);
+    while (left > 0 && sg_miter_next(&miter))
+    {
+        p = miter.addr;
+        len = min_t(size_t, miter.length, left);
+        left -= len;
+        if (tctx->fallback != NULL)
+            crypto_shash_update(desc, p, len);
+        else
+            while (len--)
+                crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    sg_miter_stop(&miter);
+    if (tctx->fallback != NULL)
+        crypto_shash_export(desc, &crc);
+    rctx->crc = crc;
+}
+
+/* Computes CRC of the request's data on a device. Falls back to software
+   if there is no device or the data can't be mapped. */
+static void crcdev_hash_device(struct ahash_request *req,
+                               struct crcdev_hash_req_ctx *rctx)
+{
+    struct crc_device *crcdev;
+    struct crc_request creq;
+    struct scatterlist *sg;
+    unsigned int left = req->nbytes;
+    int nents, mapped, i;
+    int result = 0;
+    size_t seg_len, offset;
+
+    crcdev = crcdev_get_any();
+    if (crcdev == NULL)
+    {
+        crcdev_hash_soft(req, rctx);
+        return;
+    }
+    /* Map only entries which hold the request's data. */
+    nents = 0;
+    for (sg = req->src; sg != NULL && left > 0; sg = sg_next(sg))
+    {
+        left -= min(sg->length, left);
+        nents++;
+    }
+    mapped = dma_map_sg(&crcdev->pcidev->dev, req->src, nents, DMA_TO_DEVICE);
+    if (mapped == 0)
+    {
+        crcdev_put_file(crcdev);
+        crcdev_hash_soft(req, rctx);
+        return;
+    }
+
+    /* In-kernel users are charged to the root group. */
+    creq.group = &crcdev_root_group;
+    creq.usage = NULL;
+    creq.poly = crcdev_hash_params[rctx->alg].poly;
+    creq.sum = rctx->crc;
+    left = req->nbytes;
+    for_each_sg(req->src, sg, mapped, i)
+    {
+        seg_len = min_t(size_t, sg_dma_len(sg), left);
+        /* Long segments are split, as for registered buffers. */
+        for (offset = 0; offset < seg_len; offset += creq.count)
+        {
+            /* Waits are uninterruptible, they can't fail. */
+            crcdev_get_transfer_context(crcdev, &creq, 0);
+            creq.addr = sg_dma_address(sg) + offset;
+            creq.count = min_t(size_t, seg_len - offset,
+                    CRCDEV_MAX_TRANSFER_SIZE);
+            result = crcdev_transfer(crcdev, &creq, 0);
+            put_context(crcdev, creq.ctx_no);
+            if (result)
+                break;
+        }
+        left -= seg_len;
+        if (left == 0 || result)
+            break;
+    }
+
+    dma_unmap_sg(&crcdev->pcidev->dev, req->src, nents, DMA_TO_DEVICE);
+    crcdev_put_file(crcdev);
+    /* Data of a withdrawn transfer is summed on the CPU from scratch. */
+    if (result)
+        crcdev_hash_soft(req, rctx);
+    else
+        rctx->crc = creq.sum;
+}
+
+static void crcdev_hash_final_crc(struct ahash_request *req,
+                                  struct crcdev_hash_req_ctx *rctx)
+{
+    put_unaligned_le32(rctx->crc ^ crcdev_hash_params[rctx->alg].xor_out,
+            req->result);
+}
+
+/* Runs update (and final for finup) of a long request. */
+static void crcdev_hash_work(struct work_struct *work)
+{
+    struct crcdev_hash_req_ctx *rctx =
+        container_of(work, struct crcdev_hash_req_ctx, work);
+    struct ahash_request *req = rctx->req;
+
+    crcdev_hash_device(req, rctx);
+    if (rctx->final)
+        crcdev_hash_final_crc(req, rctx);
+    local_bh_disable();
+    req->base.complete(&req->base, 0);
+    local_bh_enable();
+}
+
+static int crcdev_hash_cra_init(struct crypto_tfm *tfm)
+{
+    struct crcdev_hash_tfm_ctx *tctx = crypto_tfm_ctx(tfm);
+    struct ahash_alg *alg = __crypto_ahash_alg(tfm->__crt_alg);
+
+    tctx->alg = alg - crcdev_hash_algs;
+    tctx->key = crcdev_hash_params[tctx->alg].key;
+    /* The best driver which doesn't need a fallback itself (so not us). If
+       there is none, or its state is not a plain CRC, the table is used. */
+    tctx->fallback = crypto_alloc_shash(crcdev_hash_params[tctx->alg].name, 0,
+            CRYPTO_ALG_NEED_FALLBACK);
+    if (IS_ERR(tctx->fallback))
+        tctx->fallback = NULL;
+    else if (crypto_shash_statesize(tctx->fallback) != CRCDEV_HASH_SIZE)
+    {
+        crypto_free_shash(tctx->fallback);
+        tctx->fallback = NULL;
+    }
+    /* Requests carry the fallback's descriptor with its context. */
+    crypto_ahash_set_reqsize(__crypto_ahash_cast(tfm),
+            sizeof(struct crcdev_hash_req_ctx) + (tctx->fallback != NULL ?
+                crypto_shash_descsize(tctx->fallback) : 0));
+    return 0;
+}
+
+static void crcdev_hash_cra_exit(struct crypto_tfm *tfm)
+{
+    struct crcdev_hash_tfm_ctx *tctx = crypto_tfm_ctx(tfm);
+
+    if (tctx->fallback != NULL)
+        crypto_free_shash(tctx->fallback);
+}
+
+/* Key is the initial value (little endian), as in the generic drivers. */
+static int crcdev_hash_setkey(struct crypto_ahash *tfm, const u8 *key,
+                              unsigned int keylen)
+{
+    struct crcdev_hash_tfm_ctx *tctx = crypto_ahash_ctx(tfm);
+
+    if (keylen != CRCDEV_HASH_SIZE)
+    {
+        crypto_ahash_set_flags(tfm, CRYPTO_TFM_RES_BAD_KEY_LEN);
+        return -EINVAL;
+    }
+    tctx->key = get_unaligned_le32(key);
+    return 0;
+}
+
+static int crcdev_hash_init(struct ahash_request *req)
+{
+    struct crcdev_hash_tfm_ctx *tctx =
+        crypto_ahash_ctx(crypto_ahash_reqtfm(req));
+    struct crcdev_hash_req_ctx *rctx = ahash_request_ctx(req);
+
+    rctx->alg = tctx->alg;
+    rctx->crc = tctx->key;
+    return 0;
+}
+
+/* Computes short requests at once, queues long ones. */
+static int crcdev_hash_process(struct ahash_request *req, int final)
+{
+    struct crcdev_hash_req_ctx *rctx = ahash_request_ctx(req);
+
+    if (req->nbytes < crypto_min_size)
+    {
+        crcdev_hash_soft(req, rctx);
+        if (final)
+            crcdev_hash_final_crc(req, rctx);
+        return 0;
+    }
+    rctx->req = req;
+    rctx->final = final;
+    INIT_WORK(&rctx->work, crcdev_hash_work);
+    queue_work(crcdev_wq, &rctx->work);
+    return -EINPROGRESS;
+}
+
+static int crcdev_hash_update(struct ahash_request *req)
+{
+    return crcdev_hash_process(req, 0);
+}
+
+static int crcdev_hash_final(struct ahash_request *req)
+{
+    crcdev_hash_final_crc(req, ahash_request_ctx(req));
+    return 0;
+}
+
+static int crcdev_hash_finup(struct ahash_request *req)
+{
+    return crcdev_hash_process(req, 1);
+}
+
+static int crcdev_hash_digest(struct ahash_request *req)
+{
+    crcdev_hash_init(req);
+    return crcdev_hash_process(req, 1);
+}
+
+static int crcdev_hash_export(struct ahash_request *req, void *out)
+{
+    struct crcdev_hash_req_ctx *rctx = ahash_request_ctx(req);
+
+    memcpy(out, &rctx->crc, sizeof(rctx->crc));
+    return 0;
+}
+
+static int crcdev_hash_import(struct ahash_request *req, const void *in)
+{
+    struct crcdev_hash_tfm_ctx *tctx =
+        crypto_ahash_ctx(crypto_ahash_reqtfm(req));
+    struct crcdev_hash_req_ctx *rctx = ahash_request_ctx(req);
+
+    rctx->alg = tctx->alg;
+    memcpy(&rctx->crc, in, sizeof(rctx->crc));
+    return 0;
+}
+
+/* Registers the algorithms. */
+static int crcdev_register_hashes(void)
+{
+    struct ahash_alg *alg;
+    int i, result;
+
+    crcdev_hash_init_tables();
+    for (i = 0; i < ARRAY_SIZE(crcdev_hash_params); ++i)
+    {
+        alg = &crcdev_hash_algs[i];
+        alg->init = crcdev_hash_init;
+        alg->update = crcdev_hash_update;
+        alg->final = crcdev_hash_final;
+        alg->finup = crcdev_hash_finup;
+        alg->digest = crcdev_hash_digest;
+        alg->export = crcdev_hash_export;
+        alg->import = crcdev_hash_import;
+        alg->setkey = crcdev_hash_setkey;
+        alg->halg.digestsize = CRCDEV_HASH_SIZE;
+        alg->halg.statesize = sizeof(u32);
+        strlcpy(alg->halg.base.cra_name, crcdev_hash_params[i].name,
+                CRYPTO_MAX_ALG_NAME);
+        snprintf(alg->halg.base.cra_driver_name, CRYPTO_MAX_ALG_NAME,
+                "%s-%s", crcdev_hash_params[i].name, DRIVER_NAME);
+        alg->halg.base.cra_priority = CRCDEV_HASH_PRIORITY;
+        alg->halg.base.cra_flags = CRYPTO_ALG_TYPE_AHASH | CRYPTO_ALG_ASYNC |
+            CRYPTO_ALG_NEED_FALLBACK;
+        alg->halg.base.cra_blocksize = 1;
+        alg->halg.base.cra_ctxsize = sizeof(struct crcdev_hash_tfm_ctx);
+        alg->halg.base.cra_module = THIS_MODULE;
+        alg->halg.base.cra_init = crcdev_hash_cra_init;
+        alg->halg.base.cra_exit = crcdev_hash_cra_exit;
+
+        result = crypto_register_ahash(alg);
+        if (result)
+        {
+            printk(KERN_ERR "Can't register %s.\n",
+                    alg->halg.base.cra_driver_name);
+            while (i-- > 0)
+                crypto_unregister_ahash(&crcdev_hash_algs[i]);
+            return result;
+        }
+    }
+    return 0;
+}
+
+static void crcdev_unregister_hashes(void)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(crcdev_hash_params); ++i)
+        crypto_unregister_ahash(&crcdev_hash_algs[i]);
+}
+
+/* Registers the algorithms when the first device is ready, so that they
+   don't take precedence over the CPU's drivers on machines without one.
+   They stay registered until the module is unloaded, as tfms may outlive
+   devices. Runs in crcdev_wq, not in the probe's async context, since
+   registration may load modules. */
+static void crcdev_hash_register(struct work_struct *work)
+{
+    down(&crcdev_hashes_lock);
+    if (!crcdev_hashes_registered && crcdev_register_hashes() == 0)
+        crcdev_hashes_registered = 1;
+    up(&crcdev_hashes_lock);
+}
+
+/* GET_RESULT (without buffered data) and GET_PROGRESS read state published
+   by write without taking sem_file. */
+static long crcdev_ioctl(struct file *filp, unsigned int cmd,
+                         unsigned long arg)
+{
+    int result = 0;
+    struct file_priv_data *priv_data;
+    struct crc_context *ctx;
+    unsigned int seq;
+
+    priv_data = (struct file_priv_data *) filp->private_data;
+    /* Writing ioctls are logged with their length. */
+    if (cmd != CRCDEV_IOCTL_WRITE_FIXED && cmd != CRCDEV_IOCTL_WRITE_STREAM &&
+            cmd != CRCDEV_IOCTL_BLOCK_CRC && cmd != CRCDEV_IOCTL_BLOCK_VERIFY)
+        crcdev_trace(priv_data, CRCDEV_TRACE_IOCTL, _IOC_NR(cmd), 0);
+
+    switch (cmd) {
+    case CRCDEV_IOCTL_SET_PARAMS: {
+        struct crcdev_ioctl_set_params params;
+        struct __user crcdev_ioctl_set_params *argp;
+        argp = (struct __user crcdev_ioctl_set_params *) arg;
+        if (copy_from_user(&params, argp, sizeof(params)))
+        {
+            return -EFAULT;
+        }
+        if (down_interruptible(&priv_data->sem_file))
+        {
+            return -ERESTARTSYS;
+        }
+        ctx = priv_data->ctx;
+        write_seqcount_begin(&priv_data->seq);
+        ctx->poly = params.poly;
+        ctx->sum = params.sum;
+        /* Buffered data doesn't affect the new sum. */
+        priv_data->buffered = 0;
+        write_seqcount_end(&priv_data->seq);
+        up(&priv_data->sem_file);
+        break;
+    }    
+    case CRCDEV_IOCTL_GET_RESULT: {
+        struct crcdev_ioctl_get_result res;
+        struct __user crcdev_ioctl_get_result *argp;
+        size_t buffered;
+        argp = (struct __user crcdev_ioctl_get_result *) arg;
+        /* Result of the last finished write. Destroyed streams are freed
+           after RCU grace period. */
+        rcu_read_lock();
+        do {
+            seq = read_seqcount_begin(&priv_data->seq);
+            res.sum = priv_data->ctx->sum;
+            buffered = priv_data->buffered;
+        } while (read_seqcount_retry(&priv_data->seq, seq));
+        rcu_read_unlock();
+        /* Buffered data has to be sent to the device first. */
+        if (buffered)
+        {
+            if (down_interruptible(&priv_data->sem_file))
+            {
+                return -ERESTARTSYS;
+            }
+            result = crcdev_flush_buffer(priv_data);
+            res.sum = priv_data->ctx->sum;
+            up(&priv_data->sem_file);
+            if (result)
+                return result;
+        }
+        if (copy_to_user(argp, &res, sizeof(struct crcdev_ioctl_get_result)))
+        {
+            return -EFAULT;
+        }
+        break;
+    }
+    case CRCDEV_IOCTL_REGISTER_BUFFER: {
+        struct crcdev_ioctl_register_buffer params;
+        struct __user crcdev_ioctl_register_buffer *argp;
+        argp = (struct __user crcdev_ioctl_register_buffer *) arg;
+        if (copy_from_user(&params, argp, sizeof(params)))
+        {
+            return -EFAULT;
+        }
+        if (down_interruptible(&priv_data->sem_file))
+        {
+            return -ERESTARTSYS;
+        }
+        result = crcdev_register_buffer(priv_data, params.addr, params.len,
+                &params.id);
+        if (result == 0 && copy_to_user(argp, &params, sizeof(params)))
+        {
+            crcdev_unregister_buffer(priv_data, params.id);
+            result = -EFAULT;
+        }
+        up(&priv_data->sem_file);
+        break;
+    }
+    case CRCDEV_IOCTL_UNREGISTER_BUFFER: {
+        int busy;
+        if (arg >= MAX_FIXED_BUFFERS)
+        {
+            return -EINVAL;
+        }
+        if (down_interruptible(&priv_data->sem_file))
+        {
+            return -ERESTARTSYS;
+        }
+        /* Jobs finish under async_lock, a job seen done no longer uses the
+           buffer. New ones are submitted under sem_file, so none can start
+           until the buffer is gone. */
+        spin_lock_irq(&priv_data->async_lock);
+        busy = priv_data->async_inflight != 0;
+        spin_unlock_irq(&priv_data->async_lock);
+        if (priv_data->fixed[arg] == NULL)
+        {
+            result = -EINVAL;
+        }
+        else if (busy)
+        {
+            /* Asynchronous jobs may use the buffer. */
+            result = -EBUSY;
+        }
+        else
+        {
+            crcdev_unregister_buffer(priv_data, arg);
+        }
+        up(&priv_data->sem_file);
+        break;
+    }
+    case CRCDEV_IOCTL_WRITE_FIXED: {
+        struct crcdev_ioctl_write_fixed params;
+        struct __user crcdev_ioctl_write_fixed *argp;
+        argp = (struct __user crcdev_ioctl_write_fixed *) arg;
+        if (copy_from_user(&params, argp, sizeof(params)))
+        {
+            return -EFAULT;
+        }
+        crcdev_trace(priv_data, CRCDEV_TRACE_IOCTL, _IOC_NR(cmd), params.len);
+        if (down_interruptible(&priv_data->sem_file))
+        {
+            return -ERESTARTSYS;
+        }
+        result = crcdev_write_fixed(priv_data, &params);
+        up(&priv_data->sem_file);
+        break;
+    }
+    case CRCDEV_IOCTL_SUBMIT: {
+        struct crcdev_ioctl_submit params;
+        struct __user crcdev_ioctl_submit *argp;
+        argp = (struct __user crcdev_ioctl_submit *) arg;
+        if (copy_from_user(&params, argp, sizeof(params)))
+        {
+            return -EFAULT;
+        }
+        if (down_interruptible(&priv_data->sem_file))
+        {
+            return -ERESTARTSYS;
+        }
+        result = crcdev_submit_async(priv_data, &params);
+        up(&priv_data->sem_file);
+        break;
+    }
+    case CRCDEV_IOCTL_REAP: {
+        struct crcdev_ioctl_reap params;
+        struct __user crcdev_ioctl_reap *argp;
+        argp = (struct __user crcdev_ioctl_reap *) arg;
+        if (copy_from_user(&params, argp, sizeof(params)))
+        {
+            return -EFAULT;
+        }
+        result = crcdev_reap(priv_data, &params);
+        break;
+    }
+    case CRCDEV_IOCTL_CREATE_STREAM:
+    case CRCDEV_IOCTL_CLONE_STREAM: {
+        struct crcdev_ioctl_stream params;
+        struct __user crcdev_ioctl_stream *argp;
+        argp = (struct __user crcdev_ioctl_stream *) arg;
+        if (copy_from_user(&params, argp, sizeof(params)))
+        {
+            return -EFAULT;
+        }
+        if (down_interruptible(&priv_data->sem_file))
+        {
+            return -ERESTARTSYS;
+        }
+        if (cmd == CRCDEV_IOCTL_CREATE_STREAM)
+            result = crcdev_create_stream(priv_data, &params);
+        else
+            result = crcdev_clone_stream(priv_data, &params);
+        if (result == 0 && copy_to_user(argp, &params, sizeof(params)))
+        {
+            crcdev_destroy_stream(priv_data, params.id);
+            result = -EFAULT;
+        }
+        up(&priv_data->sem_file);
+        break;
     }
-    /* Try to get a free device's context. */
-    if (down_interruptible(&crcdev->sem_device))
-    {
-        result = sent;
-        goto intr_sem_dev;
+    case CRCDEV_IOCTL_SELECT_STREAM: {
+        if (down_interruptible(&priv_data->sem_file))
+        {
+            return -ERESTARTSYS;
+        }
+        ctx = arg <= INT_MAX ? crcdev_find_stream(priv_data, arg) : NULL;
+        if (ctx == NULL)
+            result = -EINVAL;
+        else
+            result = crcdev_switch_context(priv_data, ctx);
+        up(&priv_data->sem_file);
+        break;
     }
-    spin_lock_irqsave(&crcdev->regs_lock, flags);
-    /* Get the free context number. */
-    ctx_no = get_free_context(crcdev);
-    crcdev->ctx_status[ctx_no] = CTX_IN_USE;
-    /* Set initial values. */
-    iowrite32(ctx->sum, crcdev->addr + CRCDEV_CRC_SUM(ctx_no));
-    iowrite32(ctx->poly, crcdev->addr + CRCDEV_CRC_POLY(ctx_no));
-    spin_unlock_irqrestore(&crcdev->regs_lock, flags);
-   
-    sent = 0;
-    while (sent < count)
-    {
-        /* Copy user data to DMA buffer. */
-        to_send = (BUFFER_SIZE < count - sent) ? BUFFER_SIZE : count - sent;
-        if(copy_from_user(crcdev->dma_buffer[ctx_no], buff + sent, to_send))
-        { 
-            printk(KERN_ERR "copy_to_user failed!\n");
-            result = sent;
-            goto intr_sems_dev_file;
+    case CRCDEV_IOCTL_DESTROY_STREAM: {
+        if (arg > INT_MAX)
+        {
+            return -EINVAL;
         }
-        sent += to_send;
-
-        /* Wait until device is not busy. */
-        if (down_interruptible(&crcdev->sem_dev_busy))
+        if (down_interruptible(&priv_data->sem_file))
         {
-            result = sent;
-            goto intr_sems_dev_file;
-        };
-        spin_lock_irqsave(&crcdev->regs_lock, flags);
-        /* Set current context number. */
-        crcdev->current_ctx = ctx_no;
-
-        /* Set registers of fetch data block.  The order is important! */
-        iowrite32(ctx_no, crcdev->addr + CRCDEV_FETCH_DATA_CTX);
-        iowrite32(crcdev->dma_handle[ctx_no], crcdev->addr + CRCDEV_FETCH_DATA_ADDR);
-        iowrite32(to_send, crcdev->addr + CRCDEV_FETCH_DATA_COUNT);
-                
-        /* Wait for computation completion. */
-        init_completion(&crcdev->fetch_data_event[ctx_no]);
-        spin_unlock_irqrestore(&crcdev->regs_lock, flags);
-        wait_for_completion(&crcdev->fetch_data_event[ctx_no]); // always wait!
-        up(&crcdev->sem_dev_busy);
+            return -ERESTARTSYS;
+        }
+        result = crcdev_destroy_stream(priv_data, arg);
+        up(&priv_data->sem_file);
+        break;
     }
-
-    /* Copy final values. Free context. */
-    spin_lock_irqsave(&crcdev->regs_lock, flags);
-    ctx->sum = ioread32(crcdev->addr + CRCDEV_CRC_SUM(ctx_no));
-    crcdev->ctx_status[ctx_no] = CTX_FREE;
-    spin_unlock_irqrestore(&crcdev->regs_lock, flags);
-   
-    /* Enable other client to use this context. */
-    up(&crcdev->sem_device);
-    /* */
-    up(&priv_data->sem_file);
-    return sent;
-
-intr_sems_dev_file:
-    up(&crcdev->sem_device);
-intr_sem_dev:
-    if (ctx_no >= 0)
-    {
-        spin_lock_irqsave(&crcdev->regs_lock, flags);
-        crcdev->ctx_status[ctx_no] = CTX_FREE;
-        spin_unlock_irqrestore(&crcdev->regs_lock, flags);
+    case CRCDEV_IOCTL_WRITE_STREAM: {
+        struct crcdev_ioctl_write_stream params;
+        struct __user crcdev_ioctl_write_stream *argp;
+        argp = (struct __user crcdev_ioctl_write_stream *) arg;
+        if (copy_from_user(&params, argp, sizeof(params)))
+        {
+            return -EFAULT;
+        }
+        crcdev_trace(priv_data, CRCDEV_TRACE_IOCTL, _IOC_NR(cmd), params.len);
+        if (params.len > INT_MAX)
+        {
+            return -EINVAL;
+        }
+        if (down_interruptible(&priv_data->sem_file))
+        {
+            return -ERESTARTSYS;
+        }
+        /* The stream stays selected. */
+        ctx = crcdev_find_stream(priv_data, params.id);
+        if (ctx == NULL)
+            result = -EINVAL;
+        else
+            result = crcdev_switch_context(priv_data, ctx);
+        if (result == 0)
+            result = crcdev_write_locked(priv_data,
+                    (const char __user *) (unsigned long) params.buf,
+                    params.len);
+        up(&priv_data->sem_file);
+        break;
     }
-    up(&priv_data->sem_file);
-    return result;
-}
-
-/* */
-static int crcdev_ioctl(struct inode *inode, struct file *filp,
-                        unsigned int cmd, unsigned long arg)
-{
-    int result = 0;
-    struct file_priv_data *priv_data;
-    struct crc_device *crcdev;
-    struct crc_context *ctx;
-
-    priv_data = (struct file_priv_data *) filp->private_data;
-    crcdev = (struct crc_device *) priv_data->crcdev;
-    ctx = (struct crc_context *) priv_data->ctx;
-
-    if (down_interruptible(&priv_data->sem_file))
-    {
-        return -EINTR;
+    case CRCDEV_IOCTL_BLOCK_CRC:
+    case CRCDEV_IOCTL_BLOCK_VERIFY: {
+        struct crcdev_ioctl_block_crc params;
+        struct __user crcdev_ioctl_block_crc *argp;
+        argp = (struct __user crcdev_ioctl_block_crc *) arg;
+        if (copy_from_user(&params, argp, sizeof(params)))
+        {
+            return -EFAULT;
+        }
+        crcdev_trace(priv_data, CRCDEV_TRACE_IOCTL, _IOC_NR(cmd), params.len);
+        /* Only device's contexts are used, sem_file is not needed. */
+        result = crcdev_block_crc(priv_data, &params,
+                cmd == CRCDEV_IOCTL_BLOCK_VERIFY);
+        break;
     }
-
-    switch (cmd) {
-    case CRCDEV_IOCTL_SET_PARAMS: {
-        struct crcdev_ioctl_set_params params;
-        struct __user crcdev_ioctl_set_params *argp;
-        argp = (struct __user crcdev_ioctl_set_params *) arg;
+    case CRCDEV_IOCTL_GET_STREAM_RESULT: {
+        struct crcdev_ioctl_stream params;
+        struct __user crcdev_ioctl_stream *argp;
+        argp = (struct __user crcdev_ioctl_stream *) arg;
         if (copy_from_user(&params, argp, sizeof(params)))
         {
-            result = -EFAULT;
-            goto fail;
+            return -EFAULT;
+        }
+        if (down_interruptible(&priv_data->sem_file))
+        {
+            return -ERESTARTSYS;
+        }
+        ctx = crcdev_find_stream(priv_data, params.id);
+        if (ctx == NULL)
+            result = -EINVAL;
+        /* Only the current stream may have buffered data. */
+        else if (ctx == priv_data->ctx)
+            result = crcdev_flush_buffer(priv_data);
+        if (result == 0)
+        {
+            params.poly = ctx->poly;
+            params.sum = ctx->sum;
+        }
+        up(&priv_data->sem_file);
+        if (result == 0 && copy_to_user(argp, &params, sizeof(params)))
+        {
+            return -EFAULT;
         }
-        ctx->poly = argp->poly;
-        ctx->sum = argp->sum;
         break;
-    }    
-    case CRCDEV_IOCTL_GET_RESULT: {
-        struct crcdev_ioctl_get_result res;
-        struct __user crcdev_ioctl_get_result *argp;
-        argp = (struct __user crcdev_ioctl_get_result *) arg;
-        res.sum = ctx->sum;
-        if (copy_to_user(argp, &res, sizeof(struct crcdev_ioctl_get_result)))
+    }
+    case CRCDEV_IOCTL_GET_USAGE: {
+        struct crcdev_ioctl_usage res;
+        struct __user crcdev_ioctl_usage *argp;
+        argp = (struct __user crcdev_ioctl_usage *) arg;
+        crcdev_get_usage(priv_data, &res);
+        if (copy_to_user(argp, &res, sizeof(res)))
         {
-            result = -EFAULT;
-            goto fail;
+            return -EFAULT;
+        }
+        break;
+    }
+    case CRCDEV_IOCTL_GET_PROGRESS: {
+        struct crcdev_ioctl_get_progress res;
+        struct __user crcdev_ioctl_get_progress *argp;
+        argp = (struct __user crcdev_ioctl_get_progress *) arg;
+        do {
+            seq = read_seqcount_begin(&priv_data->seq);
+            res.sum = priv_data->progress_sum;
+            res.active = priv_data->writing;
+            res.processed = priv_data->progress_bytes;
+        } while (read_seqcount_retry(&priv_data->seq, seq));
+        if (copy_to_user(argp, &res, sizeof(struct crcdev_ioctl_get_progress)))
+        {
+            return -EFAULT;
         }
         break;
     }
     default:
-        result = -ENOTTY;
-        goto fail;
+        return -ENOTTY;
     }
-    up(&priv_data->sem_file);
-    return 0;
-
-fail:
-    up(&priv_data->sem_file);
     return result;
 }
 
-/* Adds new device when PCI bus signals. */
-static int crcdev_probe(struct pci_dev *pcidev, const struct pci_device_id *id)
+#ifdef CONFIG_COMPAT
+/* Structures have the same layout for 32-bit processes. */
+static long crcdev_compat_ioctl(struct file *filp, unsigned int cmd,
+                                unsigned long arg)
 {
-    int result = 0;
-    struct crc_device *crcdev = NULL;
-    dev_t dev = 0;
-    int crcdev_minor = 0;
+    /* Arguments of these commands are numbers, not pointers. */
+    if (cmd == CRCDEV_IOCTL_UNREGISTER_BUFFER ||
+            cmd == CRCDEV_IOCTL_SELECT_STREAM ||
+            cmd == CRCDEV_IOCTL_DESTROY_STREAM)
+        return crcdev_ioctl(filp, cmd, arg);
+    return crcdev_ioctl(filp, cmd, (unsigned long) compat_ptr(arg));
+}
+#endif
+
+/* Second part of probe, runs asynchronously: enables the device and
+   registers it. DMA buffers are allocated on first use. */
+static void crcdev_probe_async(void *data, async_cookie_t cookie)
+{
+    struct crc_device *crcdev = (struct crc_device *) data;
+    struct pci_dev *pcidev = crcdev->pcidev;
+    int crcdev_minor = MINOR(crcdev->devno);
     unsigned long flags;
+    int result;
     int i;
 
-    /* Check if there is free minor for new device. */
-    spin_lock_irqsave(&driver_lock, flags);
-    if (driver_status == REMOVE_PENDING)
-    {
-        spin_unlock_irqrestore(&driver_lock, flags); 
-        dev_err(&pcidev->dev, "Driver is about to be removed.\n");
-        return -ENXIO;
-    }
-    crcdev_minor = get_free_minor();
-    if (crcdev_minor >= MAX_DEVICES)
-    {
-        spin_unlock_irqrestore(&driver_lock, flags);
-        dev_err(&pcidev->dev, "Too many devices found.\n");
-        goto fail_max_devices;
-    }
-    minor_status[crcdev_minor] = MINOR_IN_USE;
-    spin_unlock_irqrestore(&driver_lock, flags);
-
-    /* Get major number if the first device is being added. */
-    if (crcdev_major)
-    {
-        dev = MKDEV(crcdev_major, crcdev_minor);
-        result = register_chrdev_region(dev, 1, DRIVER_NAME);
-        if (result < 0)
-        {
-            dev_err(&pcidev->dev, "register_chrdev_region failed.\n");
-            goto fail_register_alloc_chrdev_region;
-        }
-    }
-    else
-    {
-        result = alloc_chrdev_region(&dev, crcdev_minor, 1, DRIVER_NAME);
-        if (result < 0)
-        {
-            dev_err(&pcidev->dev, "alloc_chrdev_region failed.\n");
-            goto fail_register_alloc_chrdev_region;
-        }
-        crcdev_major = MAJOR(dev);
-    }
-
     /* */
     result = pci_enable_device(pcidev);
     if (result)
@@ -463,15 +3526,6 @@ static int crcdev_probe(struct pci_dev *pcidev, const struct pci_device_id *id)
         goto fail_request_regions;
     }
 
-    /* Allocate structure for new device. */
-    crcdev = (struct crc_device *) kzalloc(sizeof(struct crc_device), GFP_KERNEL);
-    if (crcdev == NULL)
-    {
-        dev_err(&pcidev->dev, "failed to allocate device.\n");
-        result = -ENOMEM;
-        goto fail_kmalloc;
-    }
-
     crcdev->addr = pci_iomap(pcidev, 0, BAR_SIZE);
     if (crcdev->addr == NULL)
     {
@@ -480,47 +3534,51 @@ static int crcdev_probe(struct pci_dev *pcidev, const struct pci_device_id *id)
         goto fail_iomap;
     }
 
-    /* Initialize other fields. */
-    crcdev->devno = MKDEV(crcdev_major, crcdev_minor);
-    crcdev->pcidev = pcidev;
-    crcdev->current_ctx = -1;
-    crcdev->open_files = 0;
-    init_completion(&crcdev->ready_to_remove_event);
+    /* Initialize CPU queues. */
+    crcdev->queues = alloc_percpu(struct crc_cpu_queue);
+    if (crcdev->queues == NULL)
+    {
+        dev_err(&pcidev->dev, "alloc_percpu failed.\n");
+        result = -ENOMEM;
+        goto fail_alloc_percpu;
+    }
+    for_each_possible_cpu(i)
+    {
+        struct crc_cpu_queue *queue = per_cpu_ptr(crcdev->queues, i);
+        init_llist_head(&queue->requests);
+    }
 
-    /* Initialize contexts. */
-    for (i = 0; i < CRCDEV_CTX_COUNT; ++i)
+    /* Start dispatcher on CPUs local to the device. */
+    crcdev->dispatcher = kthread_create(crcdev_dispatcher, crcdev,
+            "crcdev%d", crcdev_minor);
+    if (IS_ERR(crcdev->dispatcher))
     {
-        crcdev->ctx_status[i] = CTX_FREE;
-        crcdev->dma_buffer[i] = NULL;
+        dev_err(&pcidev->dev, "kthread_create failed.\n");
+        result = PTR_ERR(crcdev->dispatcher);
+        goto fail_kthread_create;
     }
+    if (crcdev->node >= 0)
+        set_cpus_allowed_ptr(crcdev->dispatcher,
+                cpumask_of_node(crcdev->node));
+    wake_up_process(crcdev->dispatcher);
 
-    /* Initialize semaphores and spinlocks. */
-    sema_init(&crcdev->sem_device, CRCDEV_CTX_COUNT);
-    sema_init(&crcdev->sem_dev_busy, 1);
-    spin_lock_init(&crcdev->regs_lock);
-    
     /* Initialize cdev struct. */
     cdev_init(&crcdev->cdev, &crcdev_file_ops);
     crcdev->cdev.owner = THIS_MODULE;
-   
-    /* Set registers default values. */
+
+    /* Set registers default values. Interrupts are enabled while there are
+       commands in the ring. */
+    iowrite32(0, crcdev->addr + CRCDEV_ENABLE);
+    iowrite32(0, crcdev->addr + CRCDEV_INTR_ENABLE);
     iowrite32(0, crcdev->addr + CRCDEV_FETCH_DATA_ADDR);
     iowrite32(0, crcdev->addr + CRCDEV_FETCH_DATA_COUNT);
     iowrite32(0, crcdev->addr + CRCDEV_FETCH_DATA_CTX);
     iowrite32(0, crcdev->addr + CRCDEV_FETCH_DATA_INTR_ACK);
-    /* Enable fetch data block. */
-    iowrite32(CRCDEV_ENABLE_FETCH_DATA, crcdev->addr + CRCDEV_ENABLE);
-    /* Enable interrupts (fetch_data). */
-    iowrite32(CRCDEV_INTR_FETCH_DATA, crcdev->addr + CRCDEV_INTR_ENABLE);
-
-    /* Register interrupt handler. */
-    result = request_irq(pcidev->irq, crcdev_irq_handler, IRQF_SHARED,
-            DRIVER_NAME, crcdev);
+
+    /* Register interrupt handlers. */
+    result = crcdev_setup_irq(crcdev);
     if (result)
-    {
-        dev_err(&pcidev->dev, "request_irq failed.\n");
         goto fail_request_irq;
-    }
 
     /* Add cdev. */
     result = cdev_add(&crcdev->cdev, crcdev->devno, 1);
@@ -545,63 +3603,185 @@ static int crcdev_probe(struct pci_dev *pcidev, const struct pci_device_id *id)
         goto fail_set_consistent_dma_mask;
     }
 
-    /* Create DMA buffer. */
-    for (i = 0; i < CRCDEV_CTX_COUNT; ++i)
+    /* Enable fetch cmd block with its ring. */
+    crcdev->cmd_ring = (__le32 *) dma_alloc_coherent(&pcidev->dev,
+            CRCDEV_CMD_RING_SIZE * CRCDEV_CMD_SIZE, &crcdev->cmd_ring_handle,
+            GFP_KERNEL);
+    if (crcdev->cmd_ring == NULL)
     {
-        crcdev->dma_buffer[i] = dma_alloc_coherent(&pcidev->dev, BUFFER_SIZE,
-                &crcdev->dma_handle[i], GFP_KERNEL);
-        if (crcdev->dma_buffer[i] == NULL)
-        {
-            dev_err(&pcidev->dev, "dma_alloc_coherent failed.\n");
-            goto fail_dma_alloc_coherent;
-        }
+        dev_err(&pcidev->dev, "Can't allocate command ring.\n");
+        result = -ENOMEM;
+        goto fail_alloc_cmd_ring;
     }
+    iowrite32(crcdev->cmd_ring_handle, crcdev->addr + CRCDEV_FETCH_CMD_ADDR);
+    iowrite32(CRCDEV_CMD_RING_SIZE, crcdev->addr + CRCDEV_FETCH_CMD_SIZE);
+    iowrite32(0, crcdev->addr + CRCDEV_FETCH_CMD_READ_POS);
+    iowrite32(0, crcdev->addr + CRCDEV_FETCH_CMD_WRITE_POS);
+    iowrite32(CRCDEV_ENABLE_FETCH_CMD, crcdev->addr + CRCDEV_ENABLE);
 
     /* Create sysfs entry. */
-    if (IS_ERR(device_create(crcdev_class, &pcidev->dev, crcdev->devno, NULL,
-                    "crc%d", crcdev_minor)))
+    crcdev->device = device_create(crcdev_class, &pcidev->dev, crcdev->devno,
+            crcdev, "crc%d", crcdev_minor);
+    if (IS_ERR(crcdev->device))
     {
         dev_err(&pcidev->dev, "Can't create sysfs entry.\n");
+        result = PTR_ERR(crcdev->device);
         goto fail_device_create;
     }
+    result = device_create_file(crcdev->device, &dev_attr_stats);
+    if (result)
+    {
+        dev_err(&pcidev->dev, "Can't create stats attribute.\n");
+        goto fail_device_create_file;
+    }
 
-    /* Set device's private data. */
-    crc_devices[crcdev_minor] = crcdev;
-    pci_set_drvdata(pcidev, crcdev);
-
+    /* From now on the device can be opened. */
     spin_lock_irqsave(&driver_lock, flags);
-    device_status[crcdev_minor] = WORKING;
+    idr_replace(&crc_devices, crcdev, crcdev_minor);
     spin_unlock_irqrestore(&driver_lock, flags);
+    /* Offer devices to in-kernel users. */
+    queue_work(crcdev_wq, &crcdev_hash_register_work);
 
     printk(KERN_NOTICE "Character device successfully added (%d,%d).\n",
-            MAJOR(dev), MINOR(dev));
-    return 0;
+            MAJOR(crcdev->devno), crcdev_minor);
+    return;
 
+fail_device_create_file:
+    device_destroy(crcdev_class, crcdev->devno);
 fail_device_create:
-    for (i = 0; i < CRCDEV_CTX_COUNT; ++i)
-        if (crcdev->dma_buffer != NULL)
-            dma_free_coherent(&pcidev->dev, BUFFER_SIZE, crcdev->dma_buffer[i],
-                    crcdev->dma_handle[i]); 
-fail_dma_alloc_coherent:
+    iowrite32(0, crcdev->addr + CRCDEV_ENABLE);
+    dma_free_coherent(&pcidev->dev, CRCDEV_CMD_RING_SIZE * CRCDEV_CMD_SIZE,
+            crcdev->cmd_ring, crcdev->cmd_ring_handle);
+fail_alloc_cmd_ring:
 fail_set_consistent_dma_mask:
 fail_set_dma_mask:
     cdev_del(&crcdev->cdev);
 fail_cdev_add:
-    free_irq(pcidev->irq, crcdev);
+    crcdev_free_irq(crcdev);
 fail_request_irq:
+    kthread_stop(crcdev->dispatcher);
+fail_kthread_create:
+    free_percpu(crcdev->queues);
+fail_alloc_percpu:
     pci_iounmap(pcidev, crcdev->addr);
 fail_iomap:
-    kfree(crcdev);
-fail_kmalloc:
     pci_release_regions(pcidev);
 fail_request_regions:
     pci_disable_device(pcidev);
 fail_enable_device:
-    unregister_chrdev_region(MKDEV(crcdev_major, crcdev_minor), 1);    
+    /* Minor and device's structure are released by crcdev_remove. */
+    crcdev->probe_result = result;
+}
+
+/* Adds new device when PCI bus signals. Only the minor and device's
+   structure are set up here, the rest is done asynchronously. */
+static int crcdev_probe(struct pci_dev *pcidev, const struct pci_device_id *id)
+{
+    int result = 0;
+    struct crc_device *crcdev = NULL;
+    dev_t dev = 0;
+    int crcdev_minor = 0;
+    unsigned long flags;
+
+    /* Reserve minor for new device. Until the device is ready, the minor
+       maps to NULL and open fails. */
+    do
+    {
+        if (!idr_pre_get(&crc_devices, GFP_KERNEL))
+        {
+            dev_err(&pcidev->dev, "idr_pre_get failed.\n");
+            return -ENOMEM;
+        }
+        spin_lock_irqsave(&driver_lock, flags);
+        if (driver_status == REMOVE_PENDING)
+        {
+            spin_unlock_irqrestore(&driver_lock, flags);
+            dev_err(&pcidev->dev, "Driver is about to be removed.\n");
+            return -ENXIO;
+        }
+        result = idr_get_new_above(&crc_devices, NULL, first_unused_minor,
+                &crcdev_minor);
+        if (result == 0)
+            first_unused_minor = crcdev_minor + 1;
+        spin_unlock_irqrestore(&driver_lock, flags);
+    } while (result == -EAGAIN);
+    if (result)
+    {
+        dev_err(&pcidev->dev, "idr_get_new_above failed.\n");
+        goto fail_max_devices;
+    }
+    if (crcdev_minor >= MAX_DEVICES)
+    {
+        dev_err(&pcidev->dev, "Too many devices found.\n");
+        result = -ENOSPC;
+        goto fail_register_alloc_chrdev_region;
+    }
+
+    /* Get major number if the first device is being added. */
+    if (crcdev_major)
+    {
+        dev = MKDEV(crcdev_major, crcdev_minor);
+        result = register_chrdev_region(dev, 1, DRIVER_NAME);
+        if (result < 0)
+        {
+            dev_err(&pcidev->dev, "register_chrdev_region failed.\n");
+            goto fail_register_alloc_chrdev_region;
+        }
+    }
+    else
+    {
+        result = alloc_chrdev_region(&dev, crcdev_minor, 1, DRIVER_NAME);
+        if (result < 0)
+        {
+            dev_err(&pcidev->dev, "alloc_chrdev_region failed.\n");
+            goto fail_register_alloc_chrdev_region;
+        }
+        crcdev_major = MAJOR(dev);
+    }
+
+    /* Allocate structure for new device (on the device's node). */
+    crcdev = (struct crc_device *) kzalloc_node(sizeof(struct crc_device),
+            GFP_KERNEL, dev_to_node(&pcidev->dev));
+    if (crcdev == NULL)
+    {
+        dev_err(&pcidev->dev, "failed to allocate device.\n");
+        result = -ENOMEM;
+        goto fail_kmalloc;
+    }
+
+    /* Initialize other fields. */
+    crcdev->devno = MKDEV(crcdev_major, crcdev_minor);
+    crcdev->pcidev = pcidev;
+    crcdev->node = dev_to_node(&pcidev->dev);
+    INIT_LIST_HEAD(&crcdev->ready);
+    INIT_LIST_HEAD(&crcdev->inflight);
+    hrtimer_init(&crcdev->coalesce_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    crcdev->coalesce_timer.function = crcdev_coalesce_timer;
+    INIT_WORK(&crcdev->stall_work, crcdev_stall_work);
+    atomic_set(&crcdev->dispatch_pending, 0);
+    /* The device holds one reference itself, dropped on removal. */
+    atomic_set(&crcdev->open_files, 1);
+    init_completion(&crcdev->ready_to_remove_event);
+    INIT_DELAYED_WORK(&crcdev->reclaim_work, crcdev_reclaim);
+
+    /* Initialize contexts. DMA buffers are allocated on first use. */
+    crcdev->ctx_busy = 0;
+    INIT_LIST_HEAD(&crcdev->ctx_waiters);
+
+    /* Initialize spinlocks. */
+    spin_lock_init(&crcdev->regs_lock);
+
+    /* Set device's private data. */
+    pci_set_drvdata(pcidev, crcdev);
+
+    crcdev->probe_cookie = async_schedule(crcdev_probe_async, crcdev);
+    return 0;
+
+fail_kmalloc:
+    unregister_chrdev_region(MKDEV(crcdev_major, crcdev_minor), 1);
 fail_register_alloc_chrdev_region:
     spin_lock_irqsave(&driver_lock, flags);
-    minor_status[crcdev_minor] = MINOR_FREE;
-    crc_devices[crcdev_minor] = NULL;
+    idr_remove(&crc_devices, crcdev_minor);
     spin_unlock_irqrestore(&driver_lock, flags);
 fail_max_devices:
     return result;
@@ -613,51 +3793,51 @@ static void crcdev_remove(struct pci_dev *pcidev)
     struct crc_device *crcdev = (struct crc_device *) pci_get_drvdata(pcidev);
     int idx = MINOR(crcdev->devno);
     unsigned long flags;
-    int i;
 
-    /* Set flag. Refuse to call open, but allow current clients to finish
-     their job. */
+    /* Wait for the asynchronous part of probe. */
+    async_synchronize_cookie(crcdev->probe_cookie + 1);
+
+    /* Remove from crc_devices. Refuse to call open, but allow current clients
+     to finish their job. */
     spin_lock_irqsave(&driver_lock, flags);
-    device_status[idx] = REMOVE_PENDING;
+    idr_remove(&crc_devices, idx);
     spin_unlock_irqrestore(&driver_lock, flags);
+    /* Failed probe has already freed device's resources. */
+    if (crcdev->probe_result)
+        goto free_device;
+    /* Wait for open calls which could still find the device. */
+    synchronize_rcu();
 
-    /* If there is at least one open file, we have to wait until all open files 
+    /* If there is at least one open file, we have to wait until all open files
        are closed. */
-    spin_lock_irqsave(&crcdev->regs_lock, flags);
-    if (crcdev->open_files > 0)
-    {
-        spin_unlock_irqrestore(&crcdev->regs_lock, flags);
+    if (!atomic_dec_and_test(&crcdev->open_files))
         wait_for_completion(&crcdev->ready_to_remove_event);
-    }
-    else
-    {
-        spin_unlock_irqrestore(&crcdev->regs_lock, flags);
-    }
+    cancel_delayed_work_sync(&crcdev->reclaim_work);
 
-    /* Leave ENABLE and INTR_ENABLE with default value. */
+    /* Leave ENABLE and INTR_ENABLE with default value. The ring is empty,
+       the timer may still be finishing. */
     iowrite32(0, crcdev->addr + CRCDEV_ENABLE);
     iowrite32(0, crcdev->addr + CRCDEV_INTR_ENABLE);
+    hrtimer_cancel(&crcdev->coalesce_timer);
+    cancel_work_sync(&crcdev->stall_work);
+    dma_free_coherent(&crcdev->pcidev->dev,
+            CRCDEV_CMD_RING_SIZE * CRCDEV_CMD_SIZE, crcdev->cmd_ring,
+            crcdev->cmd_ring_handle);
 
     /* Free resources. */
+    device_remove_file(crcdev->device, &dev_attr_stats);
     device_destroy(crcdev_class, crcdev->devno);
-    for (i = 0; i < CRCDEV_CTX_COUNT; ++i)
-        if (crcdev->dma_buffer != NULL)
-            dma_free_coherent(&pcidev->dev, BUFFER_SIZE, crcdev->dma_buffer[i],
-                crcdev->dma_handle[i]);
+    crcdev_free_dma_buffers(crcdev);
     cdev_del(&crcdev->cdev);
-    free_irq(pcidev->irq, crcdev);
+    crcdev_free_irq(crcdev);
+    kthread_stop(crcdev->dispatcher);
+    free_percpu(crcdev->queues);
     pci_iounmap(pcidev, crcdev->addr);
-    kfree(crcdev);
     pci_release_regions(crcdev->pcidev);
     pci_disable_device(crcdev->pcidev);
-    unregister_chrdev_region(crcdev->devno, 1);    
-    
-    /* Update global (driver) data structures. */
-    spin_lock_irqsave(&driver_lock, flags);
-    minor_status[idx] = MINOR_FREE;
-    crc_devices[idx] = NULL;
-    device_status[idx] = WORKING;
-    spin_unlock_irqrestore(&driver_lock, flags);
+free_device:
+    unregister_chrdev_region(crcdev->devno, 1);
+    kfree(crcdev);
 
     printk(KERN_INFO "Device (minor %d) successfully removed.\n", idx);
 }
@@ -673,7 +3853,16 @@ static void __exit crcdev_exit_module(void)
     spin_unlock_irqrestore(&driver_lock, flags);
 
     pci_unregister_driver(&crcdev_driver);
+    /* Tfms hold the module, none is left. */
+    cancel_work_sync(&crcdev_hash_register_work);
+    if (crcdev_hashes_registered)
+        crcdev_unregister_hashes();
     class_destroy(crcdev_class);
+    destroy_workqueue(crcdev_wq);
+    kmem_cache_destroy(crcdev_job_cache);
+    kmem_cache_destroy(crcdev_file_cache);
+    crcdev_debugfs_exit();
+    idr_destroy(&crc_devices);
     
     printk(KERN_NOTICE "Driver successfully removed.\n");
 }
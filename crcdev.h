@@ -37,4 +37,10 @@
 #define CRCDEV_CMD_CTX_SHIFT		30
 #define CRCDEV_CMD_CTX_MASK		0x3
 
+/* Shared by the kernel and the userspace driver. Longest transfer put into
+   one command, so that a context doesn't keep the others waiting. */
+#define CRCDEV_MAX_TRANSFER_SIZE	(1024 * 1024)
+/* Commands in the FETCH_CMD ring. */
+#define CRCDEV_CMD_RING_SIZE		16
+
 #endif
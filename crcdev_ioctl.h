@@ -20,4 +20,135 @@ struct crcdev_ioctl_get_result {
 };
 #define CRCDEV_IOCTL_GET_RESULT _IOR('C', 0x01, struct crcdev_ioctl_get_result)
 
+struct crcdev_ioctl_get_progress {
+	uint32_t sum;
+	uint32_t active;
+	uint64_t processed;
+};
+#define CRCDEV_IOCTL_GET_PROGRESS _IOR('C', 0x02, struct crcdev_ioctl_get_progress)
+
+struct crcdev_ioctl_register_buffer {
+	uint64_t addr;
+	uint64_t len;
+	uint32_t id;
+	uint32_t pad;
+};
+#define CRCDEV_IOCTL_REGISTER_BUFFER _IOWR('C', 0x03, struct crcdev_ioctl_register_buffer)
+#define CRCDEV_IOCTL_UNREGISTER_BUFFER _IO('C', 0x04)
+
+struct crcdev_ioctl_write_fixed {
+	uint32_t id;
+	uint32_t pad;
+	uint64_t offset;
+	uint64_t len;
+};
+#define CRCDEV_IOCTL_WRITE_FIXED _IOW('C', 0x05, struct crcdev_ioctl_write_fixed)
+
+/* Asynchronous requests work on registered buffers. At most
+   CRCDEV_ASYNC_DEPTH requests per file may be submitted and not reaped. */
+#define CRCDEV_ASYNC_DEPTH 256
+
+struct crcdev_ioctl_async_req {
+	uint64_t user_data;
+	uint64_t offset;
+	uint64_t len;
+	uint32_t id;
+	uint32_t poly;
+	uint32_t sum;
+	uint32_t pad;
+};
+
+struct crcdev_ioctl_submit {
+	uint64_t reqs;
+	uint32_t nr;
+	uint32_t pad;
+};
+#define CRCDEV_IOCTL_SUBMIT _IOW('C', 0x06, struct crcdev_ioctl_submit)
+
+struct crcdev_ioctl_cqe {
+	uint64_t user_data;
+	uint32_t sum;
+	int32_t result;
+};
+
+struct crcdev_ioctl_reap {
+	uint64_t cqes;
+	uint32_t nr;
+	uint32_t min_complete;
+};
+#define CRCDEV_IOCTL_REAP _IOW('C', 0x07, struct crcdev_ioctl_reap)
+
+/* Streams: independent contexts within one file. Stream 0 is the context the
+   file was opened with. write, SET_PARAMS and GET_RESULT use the selected
+   stream. */
+struct crcdev_ioctl_stream {
+	uint32_t id;
+	uint32_t poly;
+	uint32_t sum;
+	uint32_t pad;
+};
+#define CRCDEV_IOCTL_CREATE_STREAM _IOWR('C', 0x08, struct crcdev_ioctl_stream)
+#define CRCDEV_IOCTL_SELECT_STREAM _IO('C', 0x09)
+#define CRCDEV_IOCTL_DESTROY_STREAM _IO('C', 0x0a)
+
+struct crcdev_ioctl_write_stream {
+	uint32_t id;
+	uint32_t pad;
+	uint64_t buf;
+	uint64_t len;
+};
+#define CRCDEV_IOCTL_WRITE_STREAM _IOW('C', 0x0b, struct crcdev_ioctl_write_stream)
+#define CRCDEV_IOCTL_GET_STREAM_RESULT _IOWR('C', 0x0c, struct crcdev_ioctl_stream)
+#define CRCDEV_IOCTL_CLONE_STREAM _IOWR('C', 0x0d, struct crcdev_ioctl_stream)
+
+/* Per-block sums: buf is split into blocks of block_size bytes (the last one
+   may be shorter), each summed from sum with poly. BLOCK_CRC stores the sums
+   in the array at sums. BLOCK_VERIFY compares them with the array at sums,
+   sets bit i % 8 of byte i / 8 of bitmap for every mismatched block i and
+   returns the number of mismatches. Sums are raw, as from GET_RESULT. */
+struct crcdev_ioctl_block_crc {
+	uint64_t buf;
+	uint64_t len;
+	uint64_t sums;
+	uint64_t bitmap;
+	uint32_t block_size;
+	uint32_t poly;
+	uint32_t sum;
+	uint32_t pad;
+};
+#define CRCDEV_IOCTL_BLOCK_CRC _IOW('C', 0x0e, struct crcdev_ioctl_block_crc)
+#define CRCDEV_IOCTL_BLOCK_VERIFY _IOW('C', 0x0f, struct crcdev_ioctl_block_crc)
+
+/* Usage of the device by the file since it was opened, for capacity
+   planning. Times are in ns. Waits are counted for a free context and, once
+   a transfer is submitted, for the device to take it. */
+struct crcdev_ioctl_usage {
+	uint64_t bytes;		/* summed by the device */
+	uint64_t transfers;
+	uint64_t device_ns;	/* device time of the transfers */
+	uint64_t ctx_wait_ns;
+	uint64_t queue_wait_ns;
+	uint64_t copy_ns;	/* copying data to DMA buffers */
+	uint64_t pinned;	/* bytes of registered buffers */
+	uint64_t memory;	/* bytes of the file's kernel buffers */
+};
+#define CRCDEV_IOCTL_GET_USAGE _IOR('C', 0x10, struct crcdev_ioctl_usage)
+
+/* Trace records read from debugfs crcdev/trace while the trace module
+   parameter is set. */
+#define CRCDEV_TRACE_OPEN	0
+#define CRCDEV_TRACE_RELEASE	1
+#define CRCDEV_TRACE_WRITE	2
+#define CRCDEV_TRACE_IOCTL	3
+
+struct crcdev_trace_rec {
+	uint64_t time;		/* ns, monotonic */
+	uint32_t file;		/* file number, unique while the module is loaded */
+	uint32_t size;		/* bytes of write, WRITE_FIXED and WRITE_STREAM */
+	uint16_t minor;
+	uint8_t op;
+	uint8_t cmd;		/* _IOC_NR of ioctl */
+	uint32_t pad;
+};
+
 #endif
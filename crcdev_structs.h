@@ -5,60 +5,378 @@
 #include <linux/device.h>
 #include <linux/completion.h>
 #include <linux/semaphore.h>
+#include <linux/pci.h>
+#include <linux/list.h>
+#include <linux/llist.h>
+#include <linux/spinlock.h>
+#include <linux/sched.h>
+#include <linux/seqlock.h>
+#include <linux/scatterlist.h>
+#include <linux/workqueue.h>
+#include <linux/async.h>
+#include <linux/wait.h>
+#include <linux/idr.h>
+#include <linux/rcupdate.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <asm/atomic.h>
 
 
 #include "crcdev.h"
+#include "crcdev_ioctl.h"
 
 #define DRIVER_NAME     "crcdev"
 #define BAR_SIZE        4096
 #define MAX_DEVICES     256
-#define MINOR_IN_USE    1
-#define MINOR_FREE      0
-#define CTX_IN_USE      1
-#define CTX_FREE        0
 #define BUFFER_SIZE     1024 * 16
+/* Limits of buffers registered by a file. */
+#define MAX_FIXED_BUFFERS   16
+#define FIXED_BUFFER_MAX_SIZE   (1024UL * 1024 * 1024)
+/* Crypto API algorithms. */
+#define CRCDEV_HASH_SIZE        4
+#define CRCDEV_HASH_PRIORITY    300
+/* Limit of streams created by a file. */
+#define MAX_STREAMS     65536
+/* Operations kept in the trace until read. */
+#define TRACE_RECORDS   65536
+/* Blocks of BLOCK_CRC whose sums are gathered before copying to user (a
+   multiple of 8, so that the bitmap is copied in whole bytes). */
+#define BLOCK_BATCH     1024
+/* Default weight of a cgroup and longest cgroup path told apart. */
+#define CRC_GROUP_WEIGHT    100
+#define CRC_GROUP_PATH_LEN  256
 #define WORKING         0
 #define REMOVE_PENDING  1
+/* Interrupt delivery modes. */
+#define IRQ_MODE_INTX   0
+#define IRQ_MODE_MSI    1
+#define IRQ_MODE_MSIX   2
+/* MSI-X vectors (only IRQ_VECTOR_DATA is used with MSI and INTx). */
+#define IRQ_VECTOR_DATA 0
+#define IRQ_VECTOR_CMD  1
+#define IRQ_VECTORS     2
 
+struct crc_device;
+
+
+/* Per-device counters, exported through sysfs. */
+struct crc_stats {
+    /* Interrupts handled on a CPU local/remote to the device's node. */
+    atomic64_t irq_local;
+    atomic64_t irq_remote;
+    /* Writes issued from a CPU local/remote to the device's node. */
+    atomic64_t write_local;
+    atomic64_t write_remote;
+    /* Bytes copied into DMA buffers by CPUs outside the device's node. */
+    atomic64_t bytes_remote;
+    /* Requests withdrawn by their submitters and requests aborted because
+     the fetch cmd block stalled. */
+    atomic64_t cancelled;
+    atomic64_t stalls;
+    /* Transfers completed (several of them per interrupt at high load) and
+     reaps of finished transfers by the coalescing timer. */
+    atomic64_t completions;
+    atomic64_t timer_reaps;
+};
 
 struct crc_context {
     uint32_t poly;
     uint32_t sum;
 };
 
+/* Additional context of a file, created by CREATE_STREAM. */
+struct crc_stream {
+    struct crc_context context;
+    struct rcu_head rcu;
+};
+
+/* Files opened by tasks of one cgroup (of the cpu controller). Device time
+   is shared between groups in proportion to their weights and a group may
+   be limited to rate bytes per second. */
+struct crc_group {
+    /* In crcdev_groups, protected by crcdev_groups_lock as users and
+       configured. */
+    struct list_head list;
+    char path[CRC_GROUP_PATH_LEN];
+    /* Open files of the group. */
+    int users;
+    /* Set if weight or rate was changed, the group is kept without users. */
+    int configured;
+    unsigned int weight;
+    /* Bytes per second, 0 - unlimited. */
+    u64 rate;
+    /* Submissions wait until this time (ns), protected by lock. */
+    spinlock_t lock;
+    s64 throttle_until;
+    /* Device time used, scaled by CRC_GROUP_WEIGHT / weight. */
+    atomic64_t vtime;
+    /* Usage: bytes summed, device time and time spent throttled (ns). */
+    atomic64_t bytes;
+    atomic64_t device_ns;
+    atomic64_t throttled_ns;
+};
+
+/* Task (or asynchronous job) waiting for a free context of a device. */
+struct crc_ctx_waiter {
+    /* In device's ctx_waiters. */
+    struct list_head list;
+    struct crc_group *group;
+    struct task_struct *task;
+    /* Called under regs_lock instead of waking task up, if set. */
+    void (*granted)(struct crc_device *crcdev, struct crc_ctx_waiter *waiter);
+    /* Context handed over, -1 while waiting. */
+    int ctx_no;
+};
+
+/* Usage of the device by a file, returned by GET_USAGE. Times are in ns. */
+struct crc_file_usage {
+    atomic64_t bytes;
+    atomic64_t transfers;
+    atomic64_t device_ns;
+    /* Waiting for a free context and for the device to take a submitted
+       transfer. */
+    atomic64_t ctx_wait_ns;
+    atomic64_t queue_wait_ns;
+    /* Copying data to DMA buffers. */
+    atomic64_t copy_ns;
+    /* Bytes of registered buffers. */
+    atomic64_t pinned;
+};
+
+/* States of a request. */
+#define REQ_QUEUED      0
+#define REQ_READY       1
+#define REQ_ACTIVE      2
+#define REQ_DONE        3
+
+/* Single transfer of a DMA buffer, one command of the fetch cmd ring. */
+struct crc_request {
+    struct list_head list;
+    /* Entry in a CPU queue. */
+    struct llist_node queue_node;
+    /* REQ_QUEUED in a CPU queue, further states are changed under
+     regs_lock. */
+    int state;
+    /* Set when the submitter gave up, the dispatcher drops the request. */
+    int cancelled;
+    /* 0 or error of a withdrawn request. */
+    int result;
+    /* Hardware context used by the request. */
+    int ctx_no;
+    /* Group charged for the transfer and usage of its file (NULL for
+     in-kernel users). */
+    struct crc_group *group;
+    struct crc_file_usage *usage;
+    /* When the request was submitted. */
+    ktime_t submitted;
+    /* Data to process: context's DMA buffer or a registered buffer. */
+    dma_addr_t addr;
+    size_t count;
+    /* Whether poly and sum have to be loaded into context first. */
+    int load;
+    uint32_t poly;
+    /* Initial sum (if load is set), context's sum after the transfer. After
+     a failed transfer load is set again and sum is the last good one. */
+    uint32_t sum;
+    /* Signalled by interrupt handler when the transfer is done (or when the
+     request is withdrawn). */
+    struct completion done;
+    /* Called under regs_lock instead of signalling done, if set. */
+    void (*callback)(struct crc_device *crcdev, struct crc_request *req);
+};
+
+/* User's buffer pinned and mapped for DMA by REGISTER_BUFFER. */
+struct crc_fixed_buffer {
+    size_t len;
+    /* Pages of the buffer, nr_pinned of them pinned. */
+    int nr_pages;
+    int nr_pinned;
+    struct page **pages;
+    /* Segments of physically contiguous pages, nents of them mapped. */
+    struct scatterlist *sgl;
+    int nr_sg;
+    int nents;
+    /* Address space charged with the pinned pages (NULL if not charged). */
+    struct mm_struct *mm;
+};
+
+/* Request submitted by SUBMIT. Its transfers are started from the
+   completion path: each one waits for a context when the previous one is
+   done. Work runs the job when its group's rate limit allows it again. */
+struct crc_async_job {
+    struct delayed_work work;
+    struct file_priv_data *priv_data;
+    struct crc_fixed_buffer *fixed;
+    uint64_t user_data;
+    /* Segment of fixed where the next transfer starts, offset in it and
+       bytes left. */
+    struct scatterlist *sg;
+    uint64_t offset;
+    uint64_t len;
+    /* Current transfer, its poly and sum are the job's. */
+    struct crc_request req;
+    struct crc_ctx_waiter waiter;
+    /* Start of the current wait for a context or for the rate limit. */
+    ktime_t wait_start;
+};
+
+/* Context used by BLOCK_CRC, sums one block at a time. */
+struct crc_block_slot {
+    struct crc_request req;
+    int active;
+    /* Index of the block in the batch. */
+    int index;
+    const char __user *data;
+    u64 size;
+    /* Bytes of the block already summed. */
+    u64 done;
+};
+
+/* Transform of a crypto API algorithm. */
+struct crcdev_hash_tfm_ctx {
+    /* Index in crcdev_hash_params. */
+    int alg;
+    u32 key;
+    /* Another driver of the algorithm for data computed on the CPU (NULL
+       if there is none). */
+    struct crypto_shash *fallback;
+};
+
+/* Crypto API request, long ones are computed by a worker of crcdev_wq. */
+struct crcdev_hash_req_ctx {
+    struct work_struct work;
+    struct ahash_request *req;
+    int alg;
+    /* Whether the digest has to be written after the update. */
+    int final;
+    u32 crc;
+    /* Descriptor of the fallback driver, followed by its context (the
+       request size covers it). Must be the last member. */
+    struct shash_desc fallback;
+};
+
+/* Per-CPU queue of requests waiting for the dispatcher. Submitters only
+   add to it and the dispatcher takes all of it at once, so it needs no
+   lock. Newest request is first. */
+struct crc_cpu_queue {
+    struct llist_head requests;
+};
+
 struct crc_device {
     dev_t devno;
     struct cdev cdev;
     struct pci_dev *pcidev;
+    /* Device in crcdev class (sysfs). */
+    struct device *device;
+    /* NUMA node the device is attached to (-1 if unknown). */
+    int node;
+    /* Interrupt delivery mode (IRQ_MODE_*) and requested vectors. */
+    int irq_mode;
+    int nr_irqs;
+    unsigned int irq[IRQ_VECTORS];
+    struct msix_entry msix_entries[IRQ_VECTORS];
     /* Pointer to BAR0 */
     void __iomem *addr;
-    /* Semaphore for device's contexts (value = number of contexts). */
-    struct semaphore sem_device;
-    /* Only one thread can use fetch data block at the same time. */
-    struct semaphore sem_dev_busy;
     /* For device's registers and private data. */
     spinlock_t regs_lock;
-    /* Indicates which contexts are free. */
-    unsigned char ctx_status[CRCDEV_CTX_COUNT];
-    /* Completion of computations (using fetch data block). One for each
-     context. */
-    struct completion fetch_data_event[CRCDEV_CTX_COUNT];
-    /* Pointers to buffers. One for each context. */
+    /* Bitmap of contexts in use and tasks waiting for one (protected by
+       regs_lock). A context is held for one transfer at a time. */
+    unsigned long ctx_busy;
+    struct list_head ctx_waiters;
+    /* Submitters put requests into the queue of their CPU. */
+    struct crc_cpu_queue __percpu *queues;
+    /* Dispatcher thread, moves requests from CPU queues to ready list. */
+    struct task_struct *dispatcher;
+    /* Set when CPU queues may contain requests. */
+    atomic_t dispatch_pending;
+    /* First CPU queue to look at in the next round. */
+    int dispatch_cpu;
+    /* Requests waiting for fetch cmd block (protected by regs_lock). */
+    struct list_head ready;
+    /* Ring of commands of fetch cmd block and driver's positions in it
+     (protected by regs_lock). */
+    __le32 *cmd_ring;
+    dma_addr_t cmd_ring_handle;
+    unsigned int cmd_read_pos;
+    unsigned int cmd_write_pos;
+    /* Requests whose commands are in the ring, in ring order, and when the
+     ring last made progress (protected by regs_lock). */
+    struct list_head inflight;
+    int nr_inflight;
+    ktime_t ring_progress;
+    /* Whether the idle interrupt of fetch cmd block is enabled. */
+    int idle_irq;
+    /* Reaps finished commands while the ring is busy. Whether it is armed
+     is decided under regs_lock. */
+    struct hrtimer coalesce_timer;
+    int timer_armed;
+    /* Resets a stalled ring, queued by the timer. */
+    struct work_struct stall_work;
+    /* Pointers to buffers. One for each context, allocated on first use by
+     the context's owner. */
     void *dma_buffer[CRCDEV_CTX_COUNT];
     dma_addr_t dma_handle[CRCDEV_CTX_COUNT];
-    /* Number of active context. */
-    int current_ctx;
-    /* Number of currently opened files. */
-    int open_files;
+    /* Number of DMA buffer allocations which ended up outside device's
+     node. */
+    atomic_t dma_buffer_remote;
+    /* Frees DMA buffers when the device has no open files. */
+    struct delayed_work reclaim_work;
+    /* Asynchronous part of probe and its result. */
+    async_cookie_t probe_cookie;
+    int probe_result;
+    /* Number of currently opened files (plus one reference held by the
+     device until it is removed). */
+    atomic_t open_files;
     /* When device is about to be removed, it must wait until all opened files
      became closed. */
     struct completion ready_to_remove_event;
+    /* Statistics. */
+    struct crc_stats stats;
 };
 
 struct file_priv_data {
+    /* Context used by write and ioctl: context or one of streams. */
     struct crc_context *ctx;
+    struct crc_context context;
+    /* Streams of the file, by id (protected by sem_file). */
+    struct idr streams;
+    int nr_streams;
     struct crc_device *crcdev;
     struct semaphore sem_file;
+    /* Small writes gathered before being sent to the device. */
+    char *buffer;
+    size_t buffered;
+    /* Progress of current (or last) write: bytes sent to the device and sum
+     after them. */
+    int writing;
+    uint64_t progress_bytes;
+    uint32_t progress_sum;
+    /* Registered buffers (protected by sem_file). */
+    struct crc_fixed_buffer *fixed[MAX_FIXED_BUFFERS];
+    /* Protects ctx, buffered and progress. Updated under sem_file, read by
+     ioctl without locking. */
+    seqcount_t seq;
+    /* Asynchronous requests. Completions are kept in cq[cq_head..cq_tail)
+     until reaped; every job in flight has a free slot reserved. Protected
+     by async_lock, cq_head is advanced only under sem_file. */
+    spinlock_t async_lock;
+    int async_inflight;
+    unsigned int cq_head;
+    unsigned int cq_tail;
+    struct crcdev_ioctl_cqe *cq;
+    /* Woken up when a job completes. */
+    wait_queue_head_t async_wait;
+    /* Set by release, jobs not finished yet are cancelled. */
+    int closing;
+    /* Number of the file in the trace. */
+    u32 trace_id;
+    /* Group of the task which opened the file. */
+    struct crc_group *group;
+    /* In crcdev_files, with the process which opened the file. */
+    struct list_head files;
+    pid_t pid;
+    char comm[TASK_COMM_LEN];
+    struct crc_file_usage usage;
 };
 
 #endif
@@ -0,0 +1,207 @@
+/* Software model of the crcdev register file, for testing the userspace
+ * driver without hardware. CRC contexts, FETCH_DATA and FETCH_CMD behave as
+ * the device's. The FETCH_CMD block executes one command per read of
+ * READ_POS, so that drivers see it progress while they poll.
+ */
+#include "crcdev_user.h"
+#include "libcrcdev.h"
+#include "crcdev.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define MODEL_REGS 0x100
+#define MODEL_DMA_REGIONS 64
+/* Device addresses start here, 0 is never valid. */
+#define MODEL_IOVA_BASE 0x10000
+
+struct model_region {
+	void *vaddr;
+	uint64_t iova;
+	size_t len;
+};
+
+struct crcdev_model {
+	uint32_t regs[MODEL_REGS / 4];
+	struct model_region dma[MODEL_DMA_REGIONS];
+	uint64_t next_iova;
+};
+
+#define REG(m, r) ((m)->regs[(r) / 4])
+
+/* Memory at the device address, NULL if not mapped. */
+static void *model_translate(struct crcdev_model *m, uint64_t iova,
+		size_t len) {
+	int i;
+
+	for (i = 0; i < MODEL_DMA_REGIONS; i++)
+		if (m->dma[i].vaddr != NULL && iova >= m->dma[i].iova &&
+				iova + len <= m->dma[i].iova + m->dma[i].len)
+			return (char *) m->dma[i].vaddr + (iova - m->dma[i].iova);
+	return NULL;
+}
+
+static void model_crc(struct crcdev_model *m, int ctx, const void *buf,
+		size_t len) {
+	REG(m, CRCDEV_CRC_SUM(ctx)) = crcdev_soft_crc(REG(m, CRCDEV_CRC_POLY(ctx)),
+			REG(m, CRCDEV_CRC_SUM(ctx)), buf, len);
+}
+
+/* Reads count bytes at addr into the context. Unmapped addresses are
+   skipped, as a real device would just fault. */
+static void model_fetch(struct crcdev_model *m, int ctx, uint32_t addr,
+		uint32_t count) {
+	void *p = model_translate(m, addr, count);
+	if (p != NULL)
+		model_crc(m, ctx, p, count);
+}
+
+static void model_fetch_data(struct crcdev_model *m) {
+	if (!(REG(m, CRCDEV_ENABLE) & CRCDEV_ENABLE_FETCH_DATA) ||
+			REG(m, CRCDEV_FETCH_DATA_COUNT) == 0)
+		return;
+	model_fetch(m, REG(m, CRCDEV_FETCH_DATA_CTX) & CRCDEV_CMD_CTX_MASK,
+			REG(m, CRCDEV_FETCH_DATA_ADDR),
+			REG(m, CRCDEV_FETCH_DATA_COUNT));
+	REG(m, CRCDEV_FETCH_DATA_ADDR) += REG(m, CRCDEV_FETCH_DATA_COUNT);
+	REG(m, CRCDEV_FETCH_DATA_COUNT) = 0;
+	REG(m, CRCDEV_INTR) |= CRCDEV_INTR_FETCH_DATA;
+}
+
+/* Executes one command of the ring, if there is any. */
+static void model_fetch_cmd_step(struct crcdev_model *m) {
+	uint32_t size = REG(m, CRCDEV_FETCH_CMD_SIZE);
+	uint32_t pos = REG(m, CRCDEV_FETCH_CMD_READ_POS);
+	uint32_t *cmd;
+
+	if (!(REG(m, CRCDEV_ENABLE) & CRCDEV_ENABLE_FETCH_CMD) || size == 0 ||
+			pos == REG(m, CRCDEV_FETCH_CMD_WRITE_POS))
+		return;
+	cmd = model_translate(m, REG(m, CRCDEV_FETCH_CMD_ADDR) +
+			pos * CRCDEV_CMD_SIZE, CRCDEV_CMD_SIZE);
+	if (cmd != NULL)
+		model_fetch(m, cmd[1] >> CRCDEV_CMD_CTX_SHIFT & CRCDEV_CMD_CTX_MASK,
+				cmd[0], cmd[1] & CRCDEV_CMD_COUNT_MASK);
+	REG(m, CRCDEV_FETCH_CMD_READ_POS) = (pos + 1) % size;
+	if (REG(m, CRCDEV_FETCH_CMD_READ_POS) ==
+			REG(m, CRCDEV_FETCH_CMD_WRITE_POS))
+		REG(m, CRCDEV_INTR) |= CRCDEV_INTR_FETCH_CMD_IDLE;
+	REG(m, CRCDEV_INTR) |= CRCDEV_INTR_FETCH_CMD_NONFULL;
+}
+
+static uint32_t model_read(void *priv, uint32_t reg) {
+	struct crcdev_model *m = priv;
+	uint32_t status = 0;
+
+	if (reg >= MODEL_REGS)
+		return 0;
+	switch (reg) {
+	case CRCDEV_STATUS:
+		if (REG(m, CRCDEV_FETCH_DATA_COUNT) != 0)
+			status |= CRCDEV_STATUS_FETCH_DATA;
+		if (REG(m, CRCDEV_FETCH_CMD_READ_POS) !=
+				REG(m, CRCDEV_FETCH_CMD_WRITE_POS))
+			status |= CRCDEV_STATUS_FETCH_CMD;
+		return status;
+	case CRCDEV_FETCH_CMD_READ_POS:
+		model_fetch_cmd_step(m);
+		break;
+	}
+	return REG(m, reg);
+}
+
+static void model_write(void *priv, uint32_t reg, uint32_t val) {
+	struct crcdev_model *m = priv;
+	uint32_t data;
+	int ctx;
+
+	if (reg >= MODEL_REGS || (reg & 3))
+		return;
+	switch (reg) {
+	case CRCDEV_INTR:
+		/* Write 1 to clear. */
+		REG(m, reg) &= ~val;
+		return;
+	case CRCDEV_FETCH_DATA_INTR_ACK:
+		REG(m, CRCDEV_INTR) &= ~CRCDEV_INTR_FETCH_DATA;
+		return;
+	}
+	for (ctx = 0; ctx < CRCDEV_CTX_COUNT; ctx++)
+		if (reg == CRCDEV_CRC_DATA(ctx)) {
+			data = val;
+			model_crc(m, ctx, &data, sizeof(data));
+			return;
+		}
+	REG(m, reg) = val;
+	if (reg == CRCDEV_FETCH_DATA_COUNT || reg == CRCDEV_ENABLE)
+		model_fetch_data(m);
+}
+
+static void *model_dma_alloc(void *priv, size_t len, uint64_t *iova) {
+	struct crcdev_model *m = priv;
+	int i;
+
+	if (m->next_iova + len > UINT32_MAX)
+		return NULL;
+	for (i = 0; i < MODEL_DMA_REGIONS; i++)
+		if (m->dma[i].vaddr == NULL) {
+			m->dma[i].vaddr = calloc(1, len);
+			if (m->dma[i].vaddr == NULL)
+				return NULL;
+			m->dma[i].iova = m->next_iova;
+			m->dma[i].len = len;
+			/* Keep regions apart, like pages of an IOMMU. */
+			m->next_iova += (len + 0xfff) & ~(uint64_t) 0xfff;
+			*iova = m->dma[i].iova;
+			return m->dma[i].vaddr;
+		}
+	return NULL;
+}
+
+static void model_dma_free(void *priv, void *vaddr, size_t len,
+		uint64_t iova) {
+	struct crcdev_model *m = priv;
+	int i;
+
+	for (i = 0; i < MODEL_DMA_REGIONS; i++)
+		if (m->dma[i].vaddr == vaddr) {
+			free(vaddr);
+			m->dma[i].vaddr = NULL;
+			return;
+		}
+}
+
+static void model_close(void *priv) {
+	struct crcdev_model *m = priv;
+	int i;
+
+	for (i = 0; i < MODEL_DMA_REGIONS; i++)
+		free(m->dma[i].vaddr);
+	free(m);
+}
+
+const struct crcdev_regs_ops crcdev_model_ops = {
+	.read = model_read,
+	.write = model_write,
+	.dma_alloc = model_dma_alloc,
+	.dma_free = model_dma_free,
+	.close = model_close,
+};
+
+void *crcdev_model_create(void) {
+	struct crcdev_model *m = calloc(1, sizeof(*m));
+	if (m != NULL)
+		m->next_iova = MODEL_IOVA_BASE;
+	return m;
+}
+
+struct crcdev_udev *crcdev_udev_open_model(void) {
+	struct crcdev_udev *udev;
+	void *m = crcdev_model_create();
+
+	if (m == NULL)
+		return NULL;
+	udev = crcdev_udev_open(&crcdev_model_ops, m);
+	if (udev == NULL)
+		model_close(m);
+	return udev;
+}
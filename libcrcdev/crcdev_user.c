@@ -0,0 +1,171 @@
+/* Polled userspace driver of crcdev.
+ *
+ * Scheduling is simpler than in the kernel driver, which hands out contexts
+ * per transfer by cgroup weight: here a request holds one of the four
+ * hardware contexts from its first transfer to its last, so poly and sum
+ * are loaded into the context once and the sum is read back at the end.
+ * Requests waiting for a context are served in order. Contexts take turns
+ * putting transfers of at most CRCDEV_MAX_TRANSFER_SIZE into the FETCH_CMD
+ * ring, so a long request doesn't keep the others waiting; the device's
+ * READ_POS tells which of them are done.
+ */
+#include "crcdev_user.h"
+#include "crcdev.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct crcdev_udev {
+	const struct crcdev_regs_ops *ops;
+	void *priv;
+	/* Command ring. */
+	struct crcdev_dma ring;
+	uint32_t write_pos;
+	uint32_t read_pos;
+	/* Commands issued and completed so far. */
+	uint64_t issued_seq;
+	uint64_t done_seq;
+	/* Request of each context. */
+	struct crcdev_ureq *active[CRCDEV_CTX_COUNT];
+	/* Requests waiting for a context. */
+	struct crcdev_ureq *queue_head, **queue_tail;
+};
+
+static uint32_t reg_read(struct crcdev_udev *udev, uint32_t reg) {
+	return udev->ops->read(udev->priv, reg);
+}
+
+static void reg_write(struct crcdev_udev *udev, uint32_t reg, uint32_t val) {
+	udev->ops->write(udev->priv, reg, val);
+}
+
+struct crcdev_udev *crcdev_udev_open(const struct crcdev_regs_ops *ops,
+		void *priv) {
+	struct crcdev_udev *udev = calloc(1, sizeof(*udev));
+	if (udev == NULL)
+		return NULL;
+	udev->ops = ops;
+	udev->priv = priv;
+	udev->queue_tail = &udev->queue_head;
+	if (crcdev_udev_dma_alloc(udev, CRCDEV_CMD_RING_SIZE * CRCDEV_CMD_SIZE,
+				&udev->ring)) {
+		free(udev);
+		return NULL;
+	}
+
+	/* Polled mode: no interrupts, only the FETCH_CMD block. */
+	reg_write(udev, CRCDEV_ENABLE, 0);
+	reg_write(udev, CRCDEV_INTR_ENABLE, 0);
+	reg_write(udev, CRCDEV_FETCH_CMD_ADDR, udev->ring.iova);
+	reg_write(udev, CRCDEV_FETCH_CMD_SIZE, CRCDEV_CMD_RING_SIZE);
+	reg_write(udev, CRCDEV_FETCH_CMD_READ_POS, 0);
+	reg_write(udev, CRCDEV_FETCH_CMD_WRITE_POS, 0);
+	reg_write(udev, CRCDEV_ENABLE, CRCDEV_ENABLE_FETCH_CMD);
+	return udev;
+}
+
+void crcdev_udev_close(struct crcdev_udev *udev) {
+	reg_write(udev, CRCDEV_ENABLE, 0);
+	crcdev_udev_dma_free(udev, &udev->ring);
+	udev->ops->close(udev->priv);
+	free(udev);
+}
+
+int crcdev_udev_dma_alloc(struct crcdev_udev *udev, size_t len,
+		struct crcdev_dma *dma) {
+	dma->vaddr = udev->ops->dma_alloc(udev->priv, len, &dma->iova);
+	if (dma->vaddr == NULL)
+		return -1;
+	dma->len = len;
+	return 0;
+}
+
+void crcdev_udev_dma_free(struct crcdev_udev *udev, struct crcdev_dma *dma) {
+	udev->ops->dma_free(udev->priv, dma->vaddr, dma->len, dma->iova);
+	dma->vaddr = NULL;
+}
+
+void crcdev_udev_submit(struct crcdev_udev *udev, struct crcdev_ureq *req) {
+	req->next = NULL;
+	req->issued = 0;
+	req->end_seq = 0;
+	*udev->queue_tail = req;
+	udev->queue_tail = &req->next;
+}
+
+/* Puts the next transfer of the context's request into the ring if there
+   is space. The request is done when the ring gets past its last command.
+   Returns whether a transfer was put. */
+static int issue(struct crcdev_udev *udev, int ctx) {
+	struct crcdev_ureq *req = udev->active[ctx];
+	uint32_t *cmd;
+	size_t count;
+
+	if (req->issued == req->len ||
+			udev->issued_seq - udev->done_seq >= CRCDEV_CMD_RING_SIZE - 1)
+		return 0;
+	count = req->len - req->issued;
+	if (count > CRCDEV_MAX_TRANSFER_SIZE)
+		count = CRCDEV_MAX_TRANSFER_SIZE;
+	cmd = (uint32_t *) ((char *) udev->ring.vaddr +
+			udev->write_pos * CRCDEV_CMD_SIZE);
+	cmd[0] = req->iova + req->issued;
+	cmd[1] = count | (uint32_t) ctx << CRCDEV_CMD_CTX_SHIFT;
+	udev->write_pos = (udev->write_pos + 1) % CRCDEV_CMD_RING_SIZE;
+	udev->issued_seq++;
+	req->issued += count;
+	req->end_seq = udev->issued_seq;
+	return 1;
+}
+
+int crcdev_udev_poll(struct crcdev_udev *udev, struct crcdev_ureq **done,
+		int max) {
+	struct crcdev_ureq *req;
+	uint32_t read_pos;
+	uint32_t old_write_pos = udev->write_pos;
+	int ctx, issued, n = 0;
+
+	/* Commands done since the last poll. */
+	read_pos = reg_read(udev, CRCDEV_FETCH_CMD_READ_POS);
+	udev->done_seq += (read_pos + CRCDEV_CMD_RING_SIZE - udev->read_pos) %
+		CRCDEV_CMD_RING_SIZE;
+	udev->read_pos = read_pos;
+
+	for (ctx = 0; ctx < CRCDEV_CTX_COUNT; ctx++) {
+		req = udev->active[ctx];
+		/* Finished request frees its context. */
+		if (req != NULL && req->issued == req->len &&
+				udev->done_seq >= req->end_seq && n < max) {
+			req->sum = reg_read(udev, CRCDEV_CRC_SUM(ctx));
+			done[n++] = req;
+			udev->active[ctx] = req = NULL;
+		}
+		/* Free context takes the next waiting request. Nothing of the
+		   context is in the ring now, so it can be loaded. */
+		if (req == NULL && udev->queue_head != NULL) {
+			req = udev->queue_head;
+			udev->queue_head = req->next;
+			if (udev->queue_head == NULL)
+				udev->queue_tail = &udev->queue_head;
+			req->next = NULL;
+			udev->active[ctx] = req;
+			reg_write(udev, CRCDEV_CRC_SUM(ctx), req->sum);
+			reg_write(udev, CRCDEV_CRC_POLY(ctx), req->poly);
+		}
+	}
+
+	/* Contexts take turns, so that a long request doesn't fill the ring
+	   and keep the others out. */
+	do {
+		issued = 0;
+		for (ctx = 0; ctx < CRCDEV_CTX_COUNT; ctx++)
+			if (udev->active[ctx] != NULL && issue(udev, ctx))
+				issued = 1;
+	} while (issued);
+
+	/* Commands must be in memory before the device sees them. */
+	if (udev->write_pos != old_write_pos) {
+		__sync_synchronize();
+		reg_write(udev, CRCDEV_FETCH_CMD_WRITE_POS, udev->write_pos);
+	}
+	return n;
+}
@@ -0,0 +1,77 @@
+#ifndef CRCDEV_USER_H
+#define CRCDEV_USER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Userspace driver of a crcdev device. The device is driven through the
+   FETCH_CMD block with polled completion: after setup, submitting and
+   reaping requests take no syscalls and no interrupts. Not thread-safe, a
+   device is meant to be owned by one polling thread. */
+struct crcdev_udev;
+
+/* Access to the register file (BAR0). */
+struct crcdev_regs_ops {
+	uint32_t (*read)(void *priv, uint32_t reg);
+	void (*write)(void *priv, uint32_t reg, uint32_t val);
+	/* Allocates memory visible to the device at a 32-bit address. */
+	void *(*dma_alloc)(void *priv, size_t len, uint64_t *iova);
+	void (*dma_free)(void *priv, void *vaddr, size_t len, uint64_t iova);
+	void (*close)(void *priv);
+};
+
+/* Memory the device can read. */
+struct crcdev_dma {
+	void *vaddr;
+	uint64_t iova;
+	size_t len;
+};
+
+/* Request: CRC of len bytes at iova (inside memory from crcdev_udev_dma_alloc). */
+struct crcdev_ureq {
+	uint64_t iova;
+	size_t len;
+	uint32_t poly;
+	/* Initial value, result after completion. */
+	uint32_t sum;
+	void *user_data;
+	/* Private. */
+	struct crcdev_ureq *next;
+	size_t issued;
+	uint64_t end_seq;
+};
+
+/* Claims PCI function (e.g. "0000:00:04.0") through VFIO. The device must be
+   bound to vfio-pci. */
+struct crcdev_udev *crcdev_udev_open_vfio(const char *pci_addr);
+/* Software model of the register file, for testing. */
+struct crcdev_udev *crcdev_udev_open_model(void);
+/* Uses other register access. */
+struct crcdev_udev *crcdev_udev_open(const struct crcdev_regs_ops *ops,
+		void *priv);
+void crcdev_udev_close(struct crcdev_udev *udev);
+
+int crcdev_udev_dma_alloc(struct crcdev_udev *udev, size_t len,
+		struct crcdev_dma *dma);
+void crcdev_udev_dma_free(struct crcdev_udev *udev, struct crcdev_dma *dma);
+
+/* Queues a request. */
+void crcdev_udev_submit(struct crcdev_udev *udev, struct crcdev_ureq *req);
+/* Checks progress of the device, issues queued work and returns up to max
+   completed requests. Never blocks. */
+int crcdev_udev_poll(struct crcdev_udev *udev, struct crcdev_ureq **done,
+		int max);
+
+/* Software model, exported for tests of other backends. */
+void *crcdev_model_create(void);
+extern const struct crcdev_regs_ops crcdev_model_ops;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,228 @@
+/* VFIO backend of the userspace driver: claims the PCI function, maps BAR0
+ * and maps its own DMA memory through the IOMMU. All syscalls are made at
+ * setup and for DMA allocations; registers are accessed through the
+ * mapping.
+ */
+#include "crcdev_user.h"
+#include <linux/vfio.h>
+#include <linux/pci_regs.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+#include <limits.h>
+
+/* Device addresses start here, 0 is never valid. */
+#define VFIO_IOVA_BASE 0x10000
+
+struct crcdev_vfio {
+	int container;
+	int group;
+	int device;
+	volatile uint32_t *bar;
+	size_t bar_size;
+	uint64_t next_iova;
+};
+
+static uint32_t vfio_read(void *priv, uint32_t reg) {
+	struct crcdev_vfio *v = priv;
+	return v->bar[reg / 4];
+}
+
+static void vfio_write(void *priv, uint32_t reg, uint32_t val) {
+	struct crcdev_vfio *v = priv;
+	v->bar[reg / 4] = val;
+}
+
+static void *vfio_dma_alloc(void *priv, size_t len, uint64_t *iova) {
+	struct crcdev_vfio *v = priv;
+	struct vfio_iommu_type1_dma_map map;
+	void *p;
+
+	len = (len + 0xfff) & ~(size_t) 0xfff;
+	/* The device takes 32-bit addresses. */
+	if (v->next_iova + len > UINT32_MAX)
+		return NULL;
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	memset(&map, 0, sizeof(map));
+	map.argsz = sizeof(map);
+	map.flags = VFIO_DMA_MAP_FLAG_READ;
+	map.vaddr = (uintptr_t) p;
+	map.iova = v->next_iova;
+	map.size = len;
+	if (ioctl(v->container, VFIO_IOMMU_MAP_DMA, &map)) {
+		perror("VFIO_IOMMU_MAP_DMA");
+		munmap(p, len);
+		return NULL;
+	}
+	*iova = v->next_iova;
+	v->next_iova += len;
+	return p;
+}
+
+static void vfio_dma_free(void *priv, void *vaddr, size_t len,
+		uint64_t iova) {
+	struct crcdev_vfio *v = priv;
+	struct vfio_iommu_type1_dma_unmap unmap;
+
+	len = (len + 0xfff) & ~(size_t) 0xfff;
+	memset(&unmap, 0, sizeof(unmap));
+	unmap.argsz = sizeof(unmap);
+	unmap.iova = iova;
+	unmap.size = len;
+	ioctl(v->container, VFIO_IOMMU_UNMAP_DMA, &unmap);
+	munmap(vaddr, len);
+}
+
+static void vfio_close(void *priv) {
+	struct crcdev_vfio *v = priv;
+
+	if (v->bar != NULL)
+		munmap((void *) v->bar, v->bar_size);
+	if (v->device >= 0)
+		close(v->device);
+	if (v->group >= 0)
+		close(v->group);
+	if (v->container >= 0)
+		close(v->container);
+	free(v);
+}
+
+static const struct crcdev_regs_ops crcdev_vfio_ops = {
+	.read = vfio_read,
+	.write = vfio_write,
+	.dma_alloc = vfio_dma_alloc,
+	.dma_free = vfio_dma_free,
+	.close = vfio_close,
+};
+
+/* Number of the IOMMU group of the device. */
+static int vfio_group_no(const char *pci_addr) {
+	char path[PATH_MAX], link[PATH_MAX];
+	ssize_t len;
+
+	snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/iommu_group",
+			pci_addr);
+	len = readlink(path, link, sizeof(link) - 1);
+	if (len < 0) {
+		perror(path);
+		return -1;
+	}
+	link[len] = 0;
+	return atoi(basename(link));
+}
+
+/* Sets bus master, so that the device can fetch. */
+static int vfio_enable_master(struct crcdev_vfio *v) {
+	struct vfio_region_info info;
+	uint16_t cmd;
+
+	memset(&info, 0, sizeof(info));
+	info.argsz = sizeof(info);
+	info.index = VFIO_PCI_CONFIG_REGION_INDEX;
+	if (ioctl(v->device, VFIO_DEVICE_GET_REGION_INFO, &info))
+		return -1;
+	if (pread(v->device, &cmd, sizeof(cmd), info.offset + PCI_COMMAND) !=
+			sizeof(cmd))
+		return -1;
+	cmd |= PCI_COMMAND_MASTER | PCI_COMMAND_MEMORY;
+	if (pwrite(v->device, &cmd, sizeof(cmd), info.offset + PCI_COMMAND) !=
+			sizeof(cmd))
+		return -1;
+	return 0;
+}
+
+static int vfio_setup(struct crcdev_vfio *v, const char *pci_addr) {
+	struct vfio_group_status status;
+	struct vfio_region_info info;
+	char path[64];
+	int group_no;
+	void *bar;
+
+	v->container = open("/dev/vfio/vfio", O_RDWR);
+	if (v->container < 0) {
+		perror("/dev/vfio/vfio");
+		return -1;
+	}
+	if (ioctl(v->container, VFIO_GET_API_VERSION) != VFIO_API_VERSION ||
+			!ioctl(v->container, VFIO_CHECK_EXTENSION, VFIO_TYPE1_IOMMU)) {
+		fprintf(stderr, "VFIO type 1 IOMMU not supported\n");
+		return -1;
+	}
+
+	group_no = vfio_group_no(pci_addr);
+	if (group_no < 0)
+		return -1;
+	snprintf(path, sizeof(path), "/dev/vfio/%d", group_no);
+	v->group = open(path, O_RDWR);
+	if (v->group < 0) {
+		perror(path);
+		return -1;
+	}
+	memset(&status, 0, sizeof(status));
+	status.argsz = sizeof(status);
+	if (ioctl(v->group, VFIO_GROUP_GET_STATUS, &status) ||
+			!(status.flags & VFIO_GROUP_FLAGS_VIABLE)) {
+		fprintf(stderr, "%s: group not viable (are all its devices bound "
+				"to vfio-pci?)\n", path);
+		return -1;
+	}
+	if (ioctl(v->group, VFIO_GROUP_SET_CONTAINER, &v->container) ||
+			ioctl(v->container, VFIO_SET_IOMMU, VFIO_TYPE1_IOMMU)) {
+		perror("VFIO_SET_IOMMU");
+		return -1;
+	}
+
+	v->device = ioctl(v->group, VFIO_GROUP_GET_DEVICE_FD, pci_addr);
+	if (v->device < 0) {
+		perror(pci_addr);
+		return -1;
+	}
+	memset(&info, 0, sizeof(info));
+	info.argsz = sizeof(info);
+	info.index = VFIO_PCI_BAR0_REGION_INDEX;
+	if (ioctl(v->device, VFIO_DEVICE_GET_REGION_INFO, &info) ||
+			!(info.flags & VFIO_REGION_INFO_FLAG_MMAP)) {
+		fprintf(stderr, "%s: BAR0 can't be mapped\n", pci_addr);
+		return -1;
+	}
+	bar = mmap(NULL, info.size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			v->device, info.offset);
+	if (bar == MAP_FAILED) {
+		perror("mmap BAR0");
+		return -1;
+	}
+	v->bar = bar;
+	v->bar_size = info.size;
+	ioctl(v->device, VFIO_DEVICE_RESET);
+	if (vfio_enable_master(v)) {
+		fprintf(stderr, "%s: can't enable bus master\n", pci_addr);
+		return -1;
+	}
+	return 0;
+}
+
+struct crcdev_udev *crcdev_udev_open_vfio(const char *pci_addr) {
+	struct crcdev_udev *udev;
+	struct crcdev_vfio *v = calloc(1, sizeof(*v));
+
+	if (v == NULL)
+		return NULL;
+	v->container = v->group = v->device = -1;
+	v->next_iova = VFIO_IOVA_BASE;
+	if (vfio_setup(v, pci_addr)) {
+		vfio_close(v);
+		return NULL;
+	}
+	udev = crcdev_udev_open(&crcdev_vfio_ops, v);
+	if (udev == NULL)
+		vfio_close(v);
+	return udev;
+}
@@ -0,0 +1,472 @@
+/* libcrcdev - client library of crcdev.
+ *
+ * The pool keeps descriptors of all devices open; a descriptor is taken for
+ * a single computation and returned right after, so SET_PARAMS is the only
+ * per-request ioctl. Asynchronous requests are computed by one thread per
+ * descriptor. A thread takes a batch of queued requests at once. Small ones
+ * are copied into a buffer registered on its descriptor and go to the
+ * device by one SUBMIT and one REAP, so a batch costs two syscalls instead
+ * of three per request.
+ */
+#include "libcrcdev.h"
+#include "crcdev_ioctl.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+
+#define MAX_DEVICES 256
+#define DEFAULT_FDS_PER_DEVICE 2
+/* Large buffers are passed to the device in pieces of this size. */
+#define CHUNK_SIZE (1024 * 1024)
+/* Requests taken by a worker at once. */
+#define BATCH 32
+/* Requests up to this long (the driver's write buffer) are batched through
+   the registered buffer, which has room for a whole batch of them. Longer
+   ones are dominated by the transfer anyway. */
+#define SMALL_SIZE (16 * 1024)
+#define STAGING_SIZE (BATCH * SMALL_SIZE)
+
+struct pool_fd {
+	/* -1 in a software-only pool. */
+	int fd;
+	/* Buffer registered for batches of small requests (NULL until the first
+	   batch) and its id. */
+	char *staging;
+	uint32_t staging_id;
+	/* Set if the buffer can't be used, requests are then computed one by
+	   one. */
+	int no_staging;
+};
+
+struct crcdev_pool {
+	int ndevs;
+	/* Descriptors, indices of idle ones on the free stack. */
+	int nfds;
+	struct pool_fd *fds;
+	int *free_fds;
+	int nfree;
+	pthread_mutex_t fd_lock;
+	pthread_cond_t fd_cond;
+	/* Asynchronous requests: queued ones and completed ones. */
+	pthread_t *workers;
+	struct crcdev_req *queue_head, **queue_tail;
+	struct crcdev_req *done_head, **done_tail;
+	int ndone;
+	int pending;
+	int closing;
+	pthread_mutex_t req_lock;
+	pthread_cond_t req_cond;
+	pthread_cond_t done_cond;
+	/* Cross-check results of the device in software (CRCDEV_VERIFY). */
+	int verify;
+};
+
+/* Table-driven CRC. The table of the common polynomial is computed by the
+   compiler, other polynomials get a table built at run time. */
+#define CRC_POLY_IEEE 0xedb88320u
+#define CRC_BIT(c, p) (((c) >> 1) ^ ((p) & (0u - ((c) & 1))))
+#define CRC_BYTE(c, p) CRC_BIT(CRC_BIT(CRC_BIT(CRC_BIT(CRC_BIT(CRC_BIT( \
+		CRC_BIT(CRC_BIT((uint32_t) (c), p), p), p), p), p), p), p), p)
+#define CRC_T4(i, p) CRC_BYTE(i, p), CRC_BYTE((i) + 1, p), \
+		CRC_BYTE((i) + 2, p), CRC_BYTE((i) + 3, p)
+#define CRC_T16(i, p) CRC_T4(i, p), CRC_T4((i) + 4, p), \
+		CRC_T4((i) + 8, p), CRC_T4((i) + 12, p)
+#define CRC_T64(i, p) CRC_T16(i, p), CRC_T16((i) + 16, p), \
+		CRC_T16((i) + 32, p), CRC_T16((i) + 48, p)
+#define CRC_T256(p) CRC_T64(0, p), CRC_T64(64, p), CRC_T64(128, p), \
+		CRC_T64(192, p)
+
+static const uint32_t crc_table_ieee[256] = { CRC_T256(CRC_POLY_IEEE) };
+
+static __thread uint32_t crc_table_poly;
+static __thread uint32_t crc_table[256];
+static __thread int crc_table_valid;
+
+static const uint32_t *get_table(uint32_t poly) {
+	int i;
+	if (poly == CRC_POLY_IEEE)
+		return crc_table_ieee;
+	if (!crc_table_valid || crc_table_poly != poly) {
+		for (i = 0; i < 256; i++)
+			crc_table[i] = CRC_BYTE(i, poly);
+		crc_table_poly = poly;
+		crc_table_valid = 1;
+	}
+	return crc_table;
+}
+
+uint32_t crcdev_soft_crc(uint32_t poly, uint32_t sum, const void *buf,
+		size_t len) {
+	const uint32_t *table = get_table(poly);
+	const unsigned char *p = buf;
+	while (len--)
+		sum = table[(sum ^ *p++) & 0xff] ^ (sum >> 8);
+	return sum;
+}
+
+int crcdev_verify(uint32_t poly, uint32_t init, const void *buf, size_t len,
+		uint32_t sum) {
+	return crcdev_soft_crc(poly, init, buf, len) == sum ? 0 : -EIO;
+}
+
+/* Takes an idle descriptor, returns its index. */
+static int get_fd(struct crcdev_pool *pool) {
+	int i;
+	pthread_mutex_lock(&pool->fd_lock);
+	while (pool->nfree == 0)
+		pthread_cond_wait(&pool->fd_cond, &pool->fd_lock);
+	i = pool->free_fds[--pool->nfree];
+	pthread_mutex_unlock(&pool->fd_lock);
+	return i;
+}
+
+static void put_fd(struct crcdev_pool *pool, int i) {
+	pthread_mutex_lock(&pool->fd_lock);
+	pool->free_fds[pool->nfree++] = i;
+	pthread_cond_signal(&pool->fd_cond);
+	pthread_mutex_unlock(&pool->fd_lock);
+}
+
+/* Computes CRC on a device's descriptor (or in software, if fd < 0). */
+static int compute(struct crcdev_pool *pool, int fd, uint32_t poly,
+		uint32_t *sum, const void *buf, size_t len) {
+	struct crcdev_ioctl_set_params params = { poly, *sum };
+	struct crcdev_ioctl_get_result res;
+	const char *p = buf;
+	size_t done = 0;
+	ssize_t n;
+
+	if (fd < 0) {
+		*sum = crcdev_soft_crc(poly, *sum, buf, len);
+		return 0;
+	}
+	if (ioctl(fd, CRCDEV_IOCTL_SET_PARAMS, &params))
+		return -errno;
+	while (done < len) {
+		n = write(fd, p + done, len - done < CHUNK_SIZE ?
+				len - done : CHUNK_SIZE);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return n < 0 ? -errno : -EIO;
+		done += n;
+	}
+	if (ioctl(fd, CRCDEV_IOCTL_GET_RESULT, &res))
+		return -errno;
+	if (pool->verify && crcdev_verify(poly, *sum, buf, len, res.sum))
+		return -EIO;
+	*sum = res.sum;
+	return 0;
+}
+
+int crcdev_crc(struct crcdev_pool *pool, uint32_t poly, uint32_t *sum,
+		const void *buf, size_t len) {
+	int i, result;
+	i = get_fd(pool);
+	result = compute(pool, pool->fds[i].fd, poly, sum, buf, len);
+	put_fd(pool, i);
+	return result;
+}
+
+/* Registers the staging buffer of a descriptor on its first batch. Returns
+   0 if the buffer can be used. */
+static int get_staging(struct pool_fd *pfd) {
+	struct crcdev_ioctl_register_buffer params;
+	void *staging;
+
+	if (pfd->staging != NULL || pfd->no_staging)
+		return pfd->no_staging;
+	if (posix_memalign(&staging, 4096, STAGING_SIZE))
+		return -1;
+	params.addr = (uintptr_t) staging;
+	params.len = STAGING_SIZE;
+	params.pad = 0;
+	if (ioctl(pfd->fd, CRCDEV_IOCTL_REGISTER_BUFFER, &params)) {
+		free(staging);
+		pfd->no_staging = 1;
+		return -1;
+	}
+	pfd->staging = staging;
+	pfd->staging_id = params.id;
+	return 0;
+}
+
+/* Runs n requests copied into the staging buffer: one SUBMIT queues all of
+   them and REAP normally returns all of them at once. */
+static void run_staged(struct crcdev_pool *pool, struct pool_fd *pfd,
+		struct crcdev_ioctl_async_req *areqs, struct crcdev_req **staged,
+		int n) {
+	struct crcdev_ioctl_submit submit;
+	struct crcdev_ioctl_reap reap;
+	struct crcdev_ioctl_cqe cqes[BATCH];
+	struct crcdev_req *req;
+	int i, res, result = 0, submitted = 0, reaped = 0;
+
+	/* Positive result marks requests not completed yet. */
+	for (i = 0; i < n; i++)
+		staged[i]->result = 1;
+	while (submitted < n) {
+		submit.reqs = (uintptr_t) (areqs + submitted);
+		submit.nr = n - submitted;
+		submit.pad = 0;
+		res = ioctl(pfd->fd, CRCDEV_IOCTL_SUBMIT, &submit);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0) {
+			result = res < 0 ? -errno : -EIO;
+			break;
+		}
+		submitted += res;
+	}
+	while (reaped < submitted) {
+		reap.cqes = (uintptr_t) cqes;
+		reap.nr = BATCH;
+		reap.min_complete = submitted - reaped;
+		res = ioctl(pfd->fd, CRCDEV_IOCTL_REAP, &reap);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res < 0) {
+			/* Completions left in the file would be mistaken for
+			   those of the next batch. */
+			result = -errno;
+			pfd->no_staging = 1;
+			break;
+		}
+		for (i = 0; i < res; i++) {
+			req = staged[cqes[i].user_data];
+			req->result = cqes[i].result;
+			if (req->result == 0 && pool->verify &&
+					crcdev_verify(req->poly, req->sum, req->buf,
+						req->len, cqes[i].sum))
+				req->result = -EIO;
+			if (req->result == 0)
+				req->sum = cqes[i].sum;
+		}
+		reaped += res;
+	}
+	for (i = 0; i < n; i++)
+		if (staged[i]->result > 0)
+			staged[i]->result = result;
+}
+
+/* Computes a batch of requests on a descriptor. Small ones are computed
+   together through the staging buffer, the others one by one. */
+static void compute_batch(struct crcdev_pool *pool, struct pool_fd *pfd,
+		struct crcdev_req *batch) {
+	struct crcdev_ioctl_async_req areqs[BATCH];
+	struct crcdev_req *staged[BATCH], *req;
+	size_t used = 0;
+	int n = 0;
+
+	for (req = batch; req != NULL; req = req->next) {
+		if (pfd->fd < 0 || req->len == 0 || req->len > SMALL_SIZE ||
+				get_staging(pfd)) {
+			req->result = compute(pool, pfd->fd, req->poly, &req->sum,
+					req->buf, req->len);
+			continue;
+		}
+		memcpy(pfd->staging + used, req->buf, req->len);
+		areqs[n].user_data = n;
+		areqs[n].offset = used;
+		areqs[n].len = req->len;
+		areqs[n].id = pfd->staging_id;
+		areqs[n].poly = req->poly;
+		areqs[n].sum = req->sum;
+		areqs[n].pad = 0;
+		staged[n++] = req;
+		used += req->len;
+	}
+	if (n > 0)
+		run_staged(pool, pfd, areqs, staged, n);
+}
+
+static void *worker(void *arg) {
+	struct crcdev_pool *pool = arg;
+	struct crcdev_req *batch, *req, *next, **tail;
+	int n, i;
+
+	pthread_mutex_lock(&pool->req_lock);
+	for (;;) {
+		while (pool->queue_head == NULL && !pool->closing)
+			pthread_cond_wait(&pool->req_cond, &pool->req_lock);
+		if (pool->queue_head == NULL)
+			break;
+		/* Take up to BATCH requests. */
+		batch = pool->queue_head;
+		tail = &batch;
+		for (n = 0; n < BATCH && *tail != NULL; n++)
+			tail = &(*tail)->next;
+		pool->queue_head = *tail;
+		if (pool->queue_head == NULL)
+			pool->queue_tail = &pool->queue_head;
+		*tail = NULL;
+		pthread_mutex_unlock(&pool->req_lock);
+
+		i = get_fd(pool);
+		compute_batch(pool, &pool->fds[i], batch);
+		put_fd(pool, i);
+
+		pthread_mutex_lock(&pool->req_lock);
+		for (req = batch; req != NULL; req = next) {
+			next = req->next;
+			req->next = NULL;
+			*pool->done_tail = req;
+			pool->done_tail = &req->next;
+			pool->ndone++;
+			pool->pending--;
+		}
+		pthread_cond_broadcast(&pool->done_cond);
+	}
+	pthread_mutex_unlock(&pool->req_lock);
+	return NULL;
+}
+
+int crcdev_submit(struct crcdev_pool *pool, struct crcdev_req **reqs, int nr) {
+	int i;
+	pthread_mutex_lock(&pool->req_lock);
+	for (i = 0; i < nr; i++) {
+		reqs[i]->next = NULL;
+		*pool->queue_tail = reqs[i];
+		pool->queue_tail = &reqs[i]->next;
+	}
+	pool->pending += nr;
+	if (nr > BATCH)
+		pthread_cond_broadcast(&pool->req_cond);
+	else
+		pthread_cond_signal(&pool->req_cond);
+	pthread_mutex_unlock(&pool->req_lock);
+	return 0;
+}
+
+int crcdev_wait(struct crcdev_pool *pool, struct crcdev_req **done, int nr,
+		int min) {
+	int n;
+	if (min > nr)
+		min = nr;
+	pthread_mutex_lock(&pool->req_lock);
+	while (pool->ndone < min) {
+		/* Don't wait for more than can ever complete. */
+		if (pool->ndone + pool->pending < min) {
+			pthread_mutex_unlock(&pool->req_lock);
+			return -EINVAL;
+		}
+		pthread_cond_wait(&pool->done_cond, &pool->req_lock);
+	}
+	for (n = 0; n < nr && pool->done_head != NULL; n++) {
+		done[n] = pool->done_head;
+		pool->done_head = done[n]->next;
+		done[n]->next = NULL;
+		pool->ndone--;
+	}
+	if (pool->done_head == NULL)
+		pool->done_tail = &pool->done_head;
+	pthread_mutex_unlock(&pool->req_lock);
+	return n;
+}
+
+/* Closes the descriptors, then frees their staging buffers (the device
+   stops using them on close). */
+static void close_fds(struct crcdev_pool *pool) {
+	int i;
+	if (pool->fds == NULL)
+		return;
+	for (i = 0; i < pool->nfds; i++) {
+		if (pool->fds[i].fd >= 0)
+			close(pool->fds[i].fd);
+		free(pool->fds[i].staging);
+	}
+}
+
+struct crcdev_pool *crcdev_pool_open(int fds_per_device) {
+	struct crcdev_pool *pool;
+	char name[32];
+	int i, j, fd;
+
+	if (fds_per_device <= 0)
+		fds_per_device = DEFAULT_FDS_PER_DEVICE;
+	pool = calloc(1, sizeof(*pool));
+	if (pool == NULL)
+		return NULL;
+	pool->fds = calloc(MAX_DEVICES * fds_per_device, sizeof(struct pool_fd));
+	pool->free_fds = calloc(MAX_DEVICES * fds_per_device, sizeof(int));
+	if (pool->fds == NULL || pool->free_fds == NULL)
+		goto fail;
+	for (i = 0; i < MAX_DEVICES; i++) {
+		snprintf(name, sizeof(name), "/dev/crc%d", i);
+		fd = open(name, O_RDWR);
+		if (fd < 0)
+			continue;
+		pool->ndevs++;
+		pool->fds[pool->nfds++].fd = fd;
+		for (j = 1; j < fds_per_device; j++) {
+			fd = open(name, O_RDWR);
+			if (fd >= 0)
+				pool->fds[pool->nfds++].fd = fd;
+		}
+	}
+	/* Software only: descriptors stand for computing threads. */
+	if (pool->ndevs == 0)
+		for (i = 0; i < fds_per_device; i++)
+			pool->fds[pool->nfds++].fd = -1;
+	for (i = 0; i < pool->nfds; i++)
+		pool->free_fds[i] = i;
+	pool->nfree = pool->nfds;
+	pool->verify = getenv("CRCDEV_VERIFY") != NULL;
+
+	pool->queue_tail = &pool->queue_head;
+	pool->done_tail = &pool->done_head;
+	pthread_mutex_init(&pool->fd_lock, NULL);
+	pthread_cond_init(&pool->fd_cond, NULL);
+	pthread_mutex_init(&pool->req_lock, NULL);
+	pthread_cond_init(&pool->req_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+	pool->workers = calloc(pool->nfds, sizeof(pthread_t));
+	if (pool->workers == NULL)
+		goto fail;
+	for (i = 0; i < pool->nfds; i++)
+		if (pthread_create(&pool->workers[i], NULL, worker, pool))
+			break;
+	if (i < pool->nfds) {
+		/* Stop the threads already started. */
+		pthread_mutex_lock(&pool->req_lock);
+		pool->closing = 1;
+		pthread_cond_broadcast(&pool->req_cond);
+		pthread_mutex_unlock(&pool->req_lock);
+		while (i-- > 0)
+			pthread_join(pool->workers[i], NULL);
+		goto fail;
+	}
+	return pool;
+
+fail:
+	close_fds(pool);
+	free(pool->workers);
+	free(pool->fds);
+	free(pool->free_fds);
+	free(pool);
+	return NULL;
+}
+
+void crcdev_pool_close(struct crcdev_pool *pool) {
+	int i;
+	pthread_mutex_lock(&pool->req_lock);
+	pool->closing = 1;
+	pthread_cond_broadcast(&pool->req_cond);
+	pthread_mutex_unlock(&pool->req_lock);
+	for (i = 0; i < pool->nfds; i++)
+		pthread_join(pool->workers[i], NULL);
+	close_fds(pool);
+	free(pool->workers);
+	free(pool->fds);
+	free(pool->free_fds);
+	free(pool);
+}
+
+int crcdev_pool_devices(struct crcdev_pool *pool) {
+	return pool->ndevs;
+}
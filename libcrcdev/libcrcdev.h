@@ -0,0 +1,61 @@
+#ifndef LIBCRCDEV_H
+#define LIBCRCDEV_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Pool of open file descriptors of all /dev/crcN devices. All functions
+   taking a pool are thread-safe. Without devices everything is computed in
+   software. */
+struct crcdev_pool;
+
+/* Asynchronous request. buf must stay valid until the request completes. */
+struct crcdev_req {
+	const void *buf;
+	size_t len;
+	uint32_t poly;
+	/* Initial value, result after completion. */
+	uint32_t sum;
+	/* 0 or negative errno, set on completion. */
+	int result;
+	void *user_data;
+	/* Private. */
+	struct crcdev_req *next;
+};
+
+/* Opens fds_per_device descriptors of every device (0 - default). */
+struct crcdev_pool *crcdev_pool_open(int fds_per_device);
+/* Waits for submitted requests and closes the pool. */
+void crcdev_pool_close(struct crcdev_pool *pool);
+/* Number of devices used by the pool (0 - software only). */
+int crcdev_pool_devices(struct crcdev_pool *pool);
+
+/* Computes CRC of buf in the calling thread. *sum holds the initial value
+   and receives the result. Returns 0 or negative errno. */
+int crcdev_crc(struct crcdev_pool *pool, uint32_t poly, uint32_t *sum,
+		const void *buf, size_t len);
+
+/* Queues nr requests. Returns 0 or negative errno. */
+int crcdev_submit(struct crcdev_pool *pool, struct crcdev_req **reqs, int nr);
+/* Waits until at least min requests are completed and returns up to nr of
+   them in done. Returns number of returned requests or negative errno. */
+int crcdev_wait(struct crcdev_pool *pool, struct crcdev_req **done, int nr,
+		int min);
+
+/* Software CRC (the device's algorithm). */
+uint32_t crcdev_soft_crc(uint32_t poly, uint32_t sum, const void *buf,
+		size_t len);
+/* Checks a sum computed by the device against software. Returns 0 if they
+   match. */
+int crcdev_verify(uint32_t poly, uint32_t init, const void *buf, size_t len,
+		uint32_t sum);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
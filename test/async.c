@@ -0,0 +1,85 @@
+#include "test.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#define LEN 0x400000
+#define NR 64
+#define BATCH 16
+
+int main() {
+	int fd = open("/dev/crc0", O_RDWR);
+	if (fd < 0) {
+		perror("open");
+		return 1;
+	}
+	char *buf = mmap(NULL, LEN, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	gen(buf, LEN);
+	uint32_t id;
+	if (crcdev_ioctl_register_buffer(fd, buf, LEN, &id)) {
+		perror("register_buffer");
+		return 1;
+	}
+	/* The same request many times, in batches, without waiting. */
+	struct crcdev_ioctl_async_req reqs[NR];
+	int i;
+	for (i = 0; i < NR; i++) {
+		reqs[i].user_data = i;
+		reqs[i].offset = 0;
+		reqs[i].len = LEN;
+		reqs[i].id = id;
+		reqs[i].poly = 0xedb88320;
+		reqs[i].sum = 0xffffffff;
+		reqs[i].pad = 0;
+	}
+	int submitted = 0;
+	while (submitted < NR) {
+		int n = NR - submitted < BATCH ? NR - submitted : BATCH;
+		int res = crcdev_ioctl_submit(fd, reqs + submitted, n);
+		if (res < 0) {
+			perror("submit");
+			return 1;
+		}
+		submitted += res;
+	}
+	struct crcdev_ioctl_cqe cqes[NR];
+	int seen[NR] = { 0 };
+	uint32_t sum = 0;
+	int reaped = 0;
+	while (reaped < NR) {
+		int res = crcdev_ioctl_reap(fd, cqes, NR, 1);
+		if (res < 0) {
+			perror("reap");
+			return 1;
+		}
+		for (i = 0; i < res; i++) {
+			struct crcdev_ioctl_cqe *cqe = &cqes[i];
+			if (cqe->result || cqe->user_data >= NR || seen[cqe->user_data]) {
+				fprintf(stderr, "bad completion %llu (%d)\n",
+						(unsigned long long) cqe->user_data, cqe->result);
+				return 1;
+			}
+			seen[cqe->user_data] = 1;
+			if (reaped + i && cqe->sum != sum) {
+				fprintf(stderr, "sum mismatch %08x %08x\n", cqe->sum, sum);
+				return 1;
+			}
+			sum = cqe->sum;
+		}
+		reaped += res;
+	}
+	if (crcdev_ioctl_unregister_buffer(fd, id)) {
+		perror("unregister_buffer");
+		return 1;
+	}
+	sum ^= 0xffffffff;
+	printf("%08x\n", sum);
+	return 0;
+}
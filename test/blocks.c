@@ -0,0 +1,55 @@
+#include "test.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Sums of 4 KiB blocks of a 1 MiB extent (plus a short last block) in one
+   ioctl, checked against software, then verified with one damaged sum. */
+
+#define BLOCK 4096
+#define LEN (0x100000 + 100)
+#define NR_BLOCKS ((LEN + BLOCK - 1) / BLOCK)
+#define POLY 0xedb88320
+
+char buf[LEN];
+uint32_t sums[NR_BLOCKS];
+uint8_t bitmap[(NR_BLOCKS + 7) / 8];
+
+int main() {
+	int i, res, errors = 0;
+	int fd = open("/dev/crc0", O_RDWR);
+	if (fd < 0) {
+		perror("open");
+		return 1;
+	}
+	gen(buf, sizeof buf);
+	if (crcdev_ioctl_block_crc(fd, buf, LEN, BLOCK, POLY, 0xffffffff, sums)) {
+		perror("block_crc");
+		return 1;
+	}
+	for (i = 0; i < NR_BLOCKS; i++) {
+		size_t len = i == NR_BLOCKS - 1 ? LEN - i * BLOCK : BLOCK;
+		if (sums[i] != cpu_crc(POLY, 0xffffffff, buf + i * BLOCK, len)) {
+			printf("block %d: bad sum %08x\n", i, sums[i]);
+			errors++;
+		}
+	}
+
+	/* Verify reports only the damaged block. */
+	sums[42] ^= 1;
+	res = crcdev_ioctl_block_verify(fd, buf, LEN, BLOCK, POLY, 0xffffffff,
+			sums, bitmap);
+	if (res < 0) {
+		perror("block_verify");
+		return 1;
+	}
+	for (i = 0; i < NR_BLOCKS; i++)
+		if (!!(bitmap[i / 8] & 1 << (i % 8)) != (i == 42)) {
+			printf("block %d: bad bitmap bit\n", i);
+			errors++;
+		}
+	printf("%d blocks, %d mismatches, %s\n", NR_BLOCKS, res,
+			errors == 0 && res == 1 ? "OK" : "FAILED");
+	return errors != 0 || res != 1;
+}
@@ -0,0 +1,139 @@
+#include "test.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <signal.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+
+/* Writes are interrupted by signals. Interrupted transfers are withdrawn:
+   a write returns the part that was summed (or EINTR) and the result stays
+   consistent with the data accepted so far. Then two threads write to one
+   file, so that signals also come while a write waits for the other one;
+   no write may return 0. */
+
+#define LEN 0x400000
+#define POLY 0xedb88320
+#define SECONDS 2
+
+struct writers {
+	pthread_t threads[2];
+	int nr;
+};
+
+char buf[LEN];
+volatile int stop;
+
+static void handler(int sig) {
+}
+
+static void *signaller(void *arg) {
+	struct writers *writers = (struct writers *) arg;
+	struct timespec ts = { 0, 1000000 };
+	int i;
+	while (!stop) {
+		for (i = 0; i < writers->nr; i++)
+			pthread_kill(writers->threads[i], SIGUSR1);
+		nanosleep(&ts, NULL);
+	}
+	return NULL;
+}
+
+/* Writes to a file shared with another writer, returns number of writes
+   which returned 0 (-1 on error). */
+static void *shared_writer(void *arg) {
+	int fd = *(int *) arg;
+	long zero = 0;
+	ssize_t res;
+	while (!stop) {
+		res = write(fd, buf, LEN);
+		if (res == 0)
+			zero++;
+		else if (res < 0 && errno != EINTR) {
+			perror("write");
+			return (void *) -1L;
+		}
+	}
+	return (void *) zero;
+}
+
+/* Returns number of writes which returned 0, -1 on error. */
+static long run_shared(void) {
+	struct writers writers = { .nr = 2 };
+	pthread_t thread;
+	long zero = 0;
+	void *res;
+	int i, fd = open("/dev/crc0", O_RDWR);
+	if (fd < 0) {
+		perror("open");
+		return -1;
+	}
+	stop = 0;
+	for (i = 0; i < writers.nr; i++)
+		pthread_create(&writers.threads[i], NULL, shared_writer, &fd);
+	pthread_create(&thread, NULL, signaller, &writers);
+	sleep(SECONDS);
+	stop = 1;
+	pthread_join(thread, NULL);
+	for (i = 0; i < writers.nr; i++) {
+		pthread_join(writers.threads[i], &res);
+		if (zero >= 0)
+			zero = (long) res < 0 ? -1 : zero + (long) res;
+	}
+	close(fd);
+	return zero;
+}
+
+int main() {
+	struct sigaction sa = { .sa_handler = handler };
+	struct writers writers = { .threads = { pthread_self() }, .nr = 1 };
+	pthread_t thread;
+	uint32_t soft = 0xffffffff, sum;
+	long writes = 0, partial = 0, eintr = 0, zero;
+	time_t end;
+	ssize_t res;
+
+	int fd = open("/dev/crc0", O_RDWR);
+	if (fd < 0) {
+		perror("open");
+		return 1;
+	}
+	/* No SA_RESTART: interrupted writes return to us. */
+	sigaction(SIGUSR1, &sa, NULL);
+	if (crcdev_ioctl_set_params(fd, POLY, 0xffffffff)) {
+		perror("set_params");
+		return 1;
+	}
+	gen(buf, sizeof buf);
+	pthread_create(&thread, NULL, signaller, &writers);
+
+	end = time(NULL) + SECONDS;
+	while (time(NULL) < end) {
+		res = write(fd, buf, LEN);
+		writes++;
+		if (res < 0) {
+			if (errno != EINTR) {
+				perror("write");
+				return 1;
+			}
+			eintr++;
+			continue;
+		}
+		if (res < LEN)
+			partial++;
+		soft = cpu_crc(POLY, soft, buf, res);
+	}
+	stop = 1;
+	pthread_join(thread, NULL);
+
+	while (crcdev_ioctl_get_result(fd, &sum) && errno == EINTR)
+		;
+	printf("%ld writes, %ld partial, %ld interrupted: %s\n", writes, partial,
+			eintr, sum == soft ? "OK" : "FAILED");
+
+	zero = run_shared();
+	printf("shared file: %ld writes returned 0: %s\n", zero,
+			zero == 0 ? "OK" : "FAILED");
+	return sum != soft || zero != 0;
+}
@@ -0,0 +1,54 @@
+#include "test.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+
+char buf[0x400000];
+
+#define NCLONES 4
+#define PREFIX 0x300001
+
+/* The common prefix is computed once, each clone gets only the suffix. All
+   sums should be equal to the one printed by long. */
+int main() {
+	uint32_t id[NCLONES];
+	int i;
+	int fd = open("/dev/crc0", O_RDWR);
+	if (fd < 0) {
+		perror("open");
+		return 1;
+	}
+	if (crcdev_ioctl_set_params(fd, 0xedb88320, 0xffffffff)) {
+		perror("set_params");
+		return 1;
+	}
+	gen(buf, sizeof buf);
+	/* Part of the prefix stays in file's buffer. */
+	if (write(fd, buf, PREFIX) != PREFIX) {
+		perror("write");
+		return 1;
+	}
+	for (i = 0; i < NCLONES; i++) {
+		if (crcdev_ioctl_clone_stream(fd, 0, &id[i])) {
+			perror("clone_stream");
+			return 1;
+		}
+	}
+	for (i = 0; i < NCLONES; i++) {
+		if (crcdev_ioctl_write_stream(fd, id[i], buf + PREFIX,
+					sizeof buf - PREFIX) != sizeof buf - PREFIX) {
+			perror("write_stream");
+			return 1;
+		}
+	}
+	for (i = 0; i < NCLONES; i++) {
+		uint32_t sum;
+		if (crcdev_ioctl_get_stream_result(fd, id[i], &sum)) {
+			perror("get_stream_result");
+			return 1;
+		}
+		sum ^= 0xffffffff;
+		printf("%08x\n", sum);
+	}
+	return 0;
+}
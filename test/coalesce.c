@@ -0,0 +1,88 @@
+#include "test.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+/* Keeps all contexts busy and shows how many transfers were completed per
+   interrupt or reap by the coalescing timer (see coalesce_count and
+   coalesce_usecs module parameters).
+   Sums are checked against the CPU's. */
+
+#define STATS "/sys/class/crcdev/crc0/stats"
+#define THREADS 4
+#define LEN 0x400000
+#define NR 16
+#define POLY 0xedb88320
+
+char buf[LEN];
+uint32_t expected;
+
+/* Value of a counter in device's stats, -1 if there is none. */
+static long long stat(const char *name) {
+	char key[64];
+	long long val, res = -1;
+	FILE *f = fopen(STATS, "r");
+
+	if (f == NULL)
+		return -1;
+	while (fscanf(f, "%63s %lld", key, &val) == 2)
+		if (strcmp(key, name) == 0)
+			res = val;
+	fclose(f);
+	return res;
+}
+
+static void *writer(void *arg) {
+	uint32_t sum;
+	int i, fd = open("/dev/crc0", O_RDWR);
+
+	if (fd < 0) {
+		perror("open");
+		return (void *) 1;
+	}
+	for (i = 0; i < NR; i++) {
+		if (crcdev_ioctl_set_params(fd, POLY, 0xffffffff) ||
+				write(fd, buf, LEN) != LEN ||
+				crcdev_ioctl_get_result(fd, &sum)) {
+			perror("crc0");
+			return (void *) 1;
+		}
+		if (sum != expected) {
+			fprintf(stderr, "wrong sum %08x\n", sum);
+			return (void *) 1;
+		}
+	}
+	close(fd);
+	return NULL;
+}
+
+int main() {
+	pthread_t threads[THREADS];
+	long long irqs, reaps, completions;
+	void *res;
+	int i, failed = 0;
+
+	gen(buf, sizeof buf);
+	expected = cpu_crc(POLY, 0xffffffff, buf, LEN);
+	irqs = stat("irq_local") + stat("irq_remote");
+	reaps = stat("timer_reaps");
+	completions = stat("completions");
+
+	for (i = 0; i < THREADS; i++)
+		pthread_create(&threads[i], NULL, writer, NULL);
+	for (i = 0; i < THREADS; i++) {
+		pthread_join(threads[i], &res);
+		failed |= res != NULL;
+	}
+
+	irqs = stat("irq_local") + stat("irq_remote") - irqs;
+	reaps = stat("timer_reaps") - reaps;
+	completions = stat("completions") - completions;
+	printf("%lld transfers, %lld interrupts, %lld timer reaps, %.2f per reap: "
+			"%s\n", completions, irqs, reaps, irqs + reaps ?
+			(double) completions / (irqs + reaps) : 0.0,
+			failed ? "FAILED" : "OK");
+	return failed;
+}
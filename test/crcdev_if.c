@@ -15,3 +15,95 @@ int crcdev_ioctl_get_result(int fd, uint32_t *sum) {
 	*sum = arg.sum;
 	return res;
 }
+
+int crcdev_ioctl_get_progress(int fd, uint32_t *sum, uint64_t *processed) {
+	struct crcdev_ioctl_get_progress arg;
+	int res = ioctl(fd, CRCDEV_IOCTL_GET_PROGRESS, &arg);
+	if (res < 0)
+		return res;
+	*sum = arg.sum;
+	*processed = arg.processed;
+	return arg.active;
+}
+
+int crcdev_ioctl_register_buffer(int fd, void *buf, size_t len, uint32_t *id) {
+	struct crcdev_ioctl_register_buffer arg = { (uintptr_t) buf, len, 0, 0 };
+	int res = ioctl(fd, CRCDEV_IOCTL_REGISTER_BUFFER, &arg);
+	if (res < 0)
+		return res;
+	*id = arg.id;
+	return res;
+}
+
+int crcdev_ioctl_unregister_buffer(int fd, uint32_t id) {
+	return ioctl(fd, CRCDEV_IOCTL_UNREGISTER_BUFFER, id);
+}
+
+int crcdev_ioctl_write_fixed(int fd, uint32_t id, uint64_t offset, uint64_t len) {
+	struct crcdev_ioctl_write_fixed arg = { id, 0, offset, len };
+	return ioctl(fd, CRCDEV_IOCTL_WRITE_FIXED, &arg);
+}
+
+int crcdev_ioctl_submit(int fd, struct crcdev_ioctl_async_req *reqs, uint32_t nr) {
+	struct crcdev_ioctl_submit arg = { (uintptr_t) reqs, nr, 0 };
+	return ioctl(fd, CRCDEV_IOCTL_SUBMIT, &arg);
+}
+
+int crcdev_ioctl_reap(int fd, struct crcdev_ioctl_cqe *cqes, uint32_t nr, uint32_t min_complete) {
+	struct crcdev_ioctl_reap arg = { (uintptr_t) cqes, nr, min_complete };
+	return ioctl(fd, CRCDEV_IOCTL_REAP, &arg);
+}
+
+int crcdev_ioctl_create_stream(int fd, uint32_t poly, uint32_t sum, uint32_t *id) {
+	struct crcdev_ioctl_stream arg = { 0, poly, sum, 0 };
+	int res = ioctl(fd, CRCDEV_IOCTL_CREATE_STREAM, &arg);
+	if (res < 0)
+		return res;
+	*id = arg.id;
+	return res;
+}
+
+int crcdev_ioctl_select_stream(int fd, uint32_t id) {
+	return ioctl(fd, CRCDEV_IOCTL_SELECT_STREAM, id);
+}
+
+int crcdev_ioctl_destroy_stream(int fd, uint32_t id) {
+	return ioctl(fd, CRCDEV_IOCTL_DESTROY_STREAM, id);
+}
+
+int crcdev_ioctl_write_stream(int fd, uint32_t id, const void *buf, uint64_t len) {
+	struct crcdev_ioctl_write_stream arg = { id, 0, (uintptr_t) buf, len };
+	return ioctl(fd, CRCDEV_IOCTL_WRITE_STREAM, &arg);
+}
+
+int crcdev_ioctl_get_stream_result(int fd, uint32_t id, uint32_t *sum) {
+	struct crcdev_ioctl_stream arg = { id, 0, 0, 0 };
+	int res = ioctl(fd, CRCDEV_IOCTL_GET_STREAM_RESULT, &arg);
+	if (res < 0)
+		return res;
+	*sum = arg.sum;
+	return res;
+}
+
+int crcdev_ioctl_clone_stream(int fd, uint32_t src, uint32_t *id) {
+	struct crcdev_ioctl_stream arg = { src, 0, 0, 0 };
+	int res = ioctl(fd, CRCDEV_IOCTL_CLONE_STREAM, &arg);
+	if (res < 0)
+		return res;
+	*id = arg.id;
+	return res;
+}
+
+int crcdev_ioctl_block_crc(int fd, const void *buf, uint64_t len, uint32_t block_size, uint32_t poly, uint32_t sum, uint32_t *sums) {
+	struct crcdev_ioctl_block_crc arg = { (uintptr_t) buf, len, (uintptr_t) sums, 0, block_size, poly, sum, 0 };
+	return ioctl(fd, CRCDEV_IOCTL_BLOCK_CRC, &arg);
+}
+
+int crcdev_ioctl_block_verify(int fd, const void *buf, uint64_t len, uint32_t block_size, uint32_t poly, uint32_t sum, const uint32_t *sums, uint8_t *bitmap) {
+	struct crcdev_ioctl_block_crc arg = { (uintptr_t) buf, len, (uintptr_t) sums, (uintptr_t) bitmap, block_size, poly, sum, 0 };
+	return ioctl(fd, CRCDEV_IOCTL_BLOCK_VERIFY, &arg);
+}
+
+int crcdev_ioctl_get_usage(int fd, struct crcdev_ioctl_usage *usage) {
+	return ioctl(fd, CRCDEV_IOCTL_GET_USAGE, usage);
+}
@@ -0,0 +1,323 @@
+/* crcsum - computes CRCs of files using all /dev/crcN devices.
+ *
+ * Every worker owns one file descriptor of a device and takes files from a
+ * common list. A worker is split into a reader thread, which fills a ring of
+ * buffers from the file, and a writer thread, which passes full buffers to
+ * the device, so that reading and computing overlap. Without devices sums
+ * are computed in software.
+ */
+#define _GNU_SOURCE
+#include "test.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#define MAX_DEVICES 256
+#define ALIGN 4096
+
+struct file_result {
+	const char *name;
+	uint32_t sum;
+	uint64_t bytes;
+	int error;
+};
+
+/* Buffer of the ring between reader and writer. */
+struct chunk {
+	struct file_result *file;
+	char *data;
+	ssize_t len;
+};
+
+struct worker {
+	pthread_t reader, writer;
+	int dev_fd;
+	/* Ring of buffers, filled by reader, emptied by writer. */
+	struct chunk *ring;
+	int head, tail, count;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static uint32_t poly = 0xedb88320;
+static uint32_t init = 0xffffffff;
+static uint32_t xorout = 0xffffffff;
+static size_t buf_size = 1024 * 1024;
+static int nbufs = 4;
+static int use_direct;
+
+static struct file_result *files;
+static int nfiles;
+static int next_file;
+static pthread_mutex_t files_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct file_result *take_file(void) {
+	struct file_result *res = NULL;
+	pthread_mutex_lock(&files_lock);
+	if (next_file < nfiles)
+		res = &files[next_file++];
+	pthread_mutex_unlock(&files_lock);
+	return res;
+}
+
+static int open_input(const char *name) {
+	int fd = -1;
+	if (use_direct) {
+		fd = open(name, O_RDONLY | O_DIRECT);
+		/* Not every filesystem supports O_DIRECT. */
+		if (fd < 0 && errno != EINVAL)
+			return -1;
+	}
+	if (fd < 0) {
+		fd = open(name, O_RDONLY);
+		if (fd >= 0)
+			posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	}
+	return fd;
+}
+
+/* Puts a chunk into the ring. len 0 ends a file, -1 reports an error, -2
+   stops the writer. Chunks without data don't hold a buffer, so the ring
+   may still be full. */
+static void put_chunk(struct worker *w, struct chunk *c) {
+	pthread_mutex_lock(&w->lock);
+	while (w->count == nbufs)
+		pthread_cond_wait(&w->cond, &w->lock);
+	w->ring[w->tail] = *c;
+	w->tail = (w->tail + 1) % nbufs;
+	w->count++;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/* Waits for a buffer the writer is done with. */
+static char *get_free_buffer(struct worker *w, char **free_bufs, int *nfree) {
+	char *buf;
+	pthread_mutex_lock(&w->lock);
+	while (*nfree == 0)
+		pthread_cond_wait(&w->cond, &w->lock);
+	buf = free_bufs[--*nfree];
+	pthread_mutex_unlock(&w->lock);
+	return buf;
+}
+
+struct reader_state {
+	struct worker *w;
+	char **free_bufs;
+	int nfree;
+};
+
+static struct reader_state *states;
+
+static void *reader(void *arg) {
+	struct reader_state *st = arg;
+	struct worker *w = st->w;
+	struct file_result *f;
+	struct chunk c;
+
+	while ((f = take_file()) != NULL) {
+		int fd = open_input(f->name);
+		c.file = f;
+		if (fd < 0) {
+			f->error = errno;
+			c.data = NULL;
+			c.len = -1;
+			put_chunk(w, &c);
+			continue;
+		}
+		for (;;) {
+			c.data = get_free_buffer(w, st->free_bufs, &st->nfree);
+			c.len = read(fd, c.data, buf_size);
+			if (c.len < 0) {
+				f->error = errno;
+				c.len = -1;
+			}
+			put_chunk(w, &c);
+			if (c.len <= 0)
+				break;
+		}
+		close(fd);
+	}
+	c.file = NULL;
+	c.data = NULL;
+	c.len = -2;
+	put_chunk(w, &c);
+	return NULL;
+}
+
+static void *writer(void *arg) {
+	struct reader_state *st = arg;
+	struct worker *w = st->w;
+	struct chunk c;
+	uint32_t sum = init;
+	int started = 0;
+
+	for (;;) {
+		pthread_mutex_lock(&w->lock);
+		while (w->count == 0)
+			pthread_cond_wait(&w->cond, &w->lock);
+		c = w->ring[w->head];
+		w->head = (w->head + 1) % nbufs;
+		w->count--;
+		pthread_cond_broadcast(&w->cond);
+		pthread_mutex_unlock(&w->lock);
+
+		if (c.len == -2)
+			break;
+		struct file_result *f = c.file;
+		if (!started) {
+			sum = init;
+			if (w->dev_fd >= 0 && crcdev_ioctl_set_params(w->dev_fd, poly, init))
+				f->error = errno;
+			started = 1;
+		}
+		if (c.len > 0) {
+			if (w->dev_fd < 0) {
+				sum = cpu_crc(poly, sum, c.data, c.len);
+			} else if (!f->error) {
+				ssize_t done = 0;
+				while (done < c.len) {
+					ssize_t res = write(w->dev_fd, c.data + done, c.len - done);
+					if (res <= 0) {
+						f->error = res < 0 ? errno : EIO;
+						break;
+					}
+					done += res;
+				}
+			}
+			f->bytes += c.len;
+		} else {
+			/* End of file (or error). */
+			if (w->dev_fd >= 0 && !f->error &&
+					crcdev_ioctl_get_result(w->dev_fd, &sum))
+				f->error = errno;
+			f->sum = sum ^ xorout;
+			started = 0;
+		}
+		if (c.data) {
+			pthread_mutex_lock(&w->lock);
+			st->free_bufs[st->nfree++] = c.data;
+			pthread_cond_broadcast(&w->cond);
+			pthread_mutex_unlock(&w->lock);
+		}
+	}
+	return NULL;
+}
+
+static int find_devices(int *devs, int max) {
+	char name[32];
+	int i, n = 0;
+	for (i = 0; i < MAX_DEVICES && n < max; i++) {
+		snprintf(name, sizeof(name), "/dev/crc%d", i);
+		if (access(name, F_OK) == 0)
+			devs[n++] = i;
+	}
+	return n;
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr, "usage: %s [-p poly] [-s init] [-x xorout] [-j fds_per_device]\n"
+			"       [-b buffer_size] [-n buffers] [-d] [-S] file...\n"
+			"  -j  workers (fds) per device, or workers when computing in software\n"
+			"  -d  read with O_DIRECT\n"
+			"  -S  compute in software even if devices are present\n", prog);
+}
+
+int main(int argc, char **argv) {
+	int per_dev = 2, software = 0;
+	int devs[MAX_DEVICES], ndevs, nworkers;
+	int opt, i, j, errors = 0;
+	struct worker *workers;
+	struct timeval start, end;
+	uint64_t total = 0;
+
+	while ((opt = getopt(argc, argv, "p:s:x:j:b:n:dS")) != -1) {
+		switch (opt) {
+		case 'p': poly = strtoul(optarg, NULL, 0); break;
+		case 's': init = strtoul(optarg, NULL, 0); break;
+		case 'x': xorout = strtoul(optarg, NULL, 0); break;
+		case 'j': per_dev = atoi(optarg); break;
+		case 'b': buf_size = strtoul(optarg, NULL, 0); break;
+		case 'n': nbufs = atoi(optarg); break;
+		case 'd': use_direct = 1; break;
+		case 'S': software = 1; break;
+		default: usage(argv[0]); return 2;
+		}
+	}
+	if (optind >= argc || per_dev < 1 || nbufs < 2 || buf_size == 0) {
+		usage(argv[0]);
+		return 2;
+	}
+	buf_size = (buf_size + ALIGN - 1) / ALIGN * ALIGN;
+
+	nfiles = argc - optind;
+	files = calloc(nfiles, sizeof(*files));
+	for (i = 0; i < nfiles; i++)
+		files[i].name = argv[optind + i];
+
+	ndevs = software ? 0 : find_devices(devs, MAX_DEVICES);
+	nworkers = ndevs ? ndevs * per_dev : per_dev;
+	if (nworkers > nfiles)
+		nworkers = nfiles;
+	workers = calloc(nworkers, sizeof(*workers));
+	states = calloc(nworkers, sizeof(*states));
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < nworkers; i++) {
+		struct worker *w = &workers[i];
+		w->dev_fd = -1;
+		if (ndevs) {
+			/* Consecutive workers use different devices. */
+			char name[32];
+			snprintf(name, sizeof(name), "/dev/crc%d", devs[i % ndevs]);
+			w->dev_fd = open(name, O_RDWR);
+			if (w->dev_fd < 0) {
+				perror(name);
+				return 1;
+			}
+		}
+		w->ring = calloc(nbufs, sizeof(*w->ring));
+		pthread_mutex_init(&w->lock, NULL);
+		pthread_cond_init(&w->cond, NULL);
+		states[i].w = w;
+		states[i].free_bufs = calloc(nbufs, sizeof(char *));
+		for (j = 0; j < nbufs; j++) {
+			if (posix_memalign((void **) &states[i].free_bufs[j], ALIGN, buf_size)) {
+				fprintf(stderr, "out of memory\n");
+				return 1;
+			}
+		}
+		states[i].nfree = nbufs;
+		pthread_create(&w->reader, NULL, reader, &states[i]);
+		pthread_create(&w->writer, NULL, writer, &states[i]);
+	}
+	for (i = 0; i < nworkers; i++) {
+		pthread_join(workers[i].reader, NULL);
+		pthread_join(workers[i].writer, NULL);
+		if (workers[i].dev_fd >= 0)
+			close(workers[i].dev_fd);
+	}
+	gettimeofday(&end, NULL);
+
+	for (i = 0; i < nfiles; i++) {
+		if (files[i].error) {
+			fprintf(stderr, "%s: %s\n", files[i].name, strerror(files[i].error));
+			errors++;
+			continue;
+		}
+		printf("%08x  %s\n", files[i].sum, files[i].name);
+		total += files[i].bytes;
+	}
+	double secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+	fprintf(stderr, "%llu bytes in %.3f s (%.1f MB/s), %d device(s), %d worker(s)\n",
+			(unsigned long long) total, secs,
+			secs > 0 ? total / secs / 1e6 : 0.0, ndevs, nworkers);
+	return errors ? 1 : 0;
+}
@@ -0,0 +1,60 @@
+#include "test.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+
+#define LEN 0x400000
+
+int main() {
+	int fd = open("/dev/crc0", O_RDWR);
+	if (fd < 0) {
+		perror("open");
+		return 1;
+	}
+	if (crcdev_ioctl_set_params(fd, 0xedb88320, 0xffffffff)) {
+		perror("set_params");
+		return 1;
+	}
+	/* Huge pages give long physically contiguous segments. */
+	char *buf = mmap(NULL, LEN, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (buf == MAP_FAILED)
+		buf = mmap(NULL, LEN, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	gen(buf, LEN);
+	uint32_t id;
+	if (crcdev_ioctl_register_buffer(fd, buf, LEN, &id)) {
+		perror("register_buffer");
+		return 1;
+	}
+	/* Small write in between must keep its place. */
+	if (crcdev_ioctl_write_fixed(fd, id, 0, 1000)) {
+		perror("write_fixed");
+		return 1;
+	}
+	if (write(fd, buf + 1000, 1000) != 1000) {
+		perror("write");
+		return 1;
+	}
+	if (crcdev_ioctl_write_fixed(fd, id, 2000, LEN - 2000)) {
+		perror("write_fixed");
+		return 1;
+	}
+	if (crcdev_ioctl_unregister_buffer(fd, id)) {
+		perror("unregister_buffer");
+		return 1;
+	}
+	uint32_t sum;
+	if (crcdev_ioctl_get_result(fd, &sum)) {
+		perror("get_result");
+		return 1;
+	}
+	sum ^= 0xffffffff;
+	printf("%08x\n", sum);
+	return 0;
+}
@@ -11,3 +11,28 @@ void gen(char *buf, size_t len) {
 		buf[i] = jrand48(state);
 	}
 }
+
+/* Table of the last poly used by cpu_crc in this thread. */
+static __thread uint32_t crc_table[256];
+static __thread uint32_t crc_table_poly;
+static __thread int crc_table_ready;
+
+/* Continues reflected CRC sum of poly (without the final xor) over buf, as
+   the device does. The table is built again only when poly changes. */
+uint32_t cpu_crc(uint32_t poly, uint32_t sum, const char *buf, size_t len) {
+	uint32_t c;
+	int i, k;
+	if (!crc_table_ready || crc_table_poly != poly) {
+		for (i = 0; i < 256; i++) {
+			c = i;
+			for (k = 0; k < 8; k++)
+				c = c & 1 ? (c >> 1) ^ poly : c >> 1;
+			crc_table[i] = c;
+		}
+		crc_table_poly = poly;
+		crc_table_ready = 1;
+	}
+	while (len--)
+		sum = crc_table[(sum ^ (unsigned char) *buf++) & 0xff] ^ (sum >> 8);
+	return sum;
+}
@@ -0,0 +1,106 @@
+#include "test.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/* Limits the rate of our own cgroup (of the cpu controller) through
+   debugfs and compares throughput of writes with and without the limit.
+   Needs root and debugfs mounted at /sys/kernel/debug. */
+
+#define GROUPS "/sys/kernel/debug/crcdev/groups"
+#define LEN 0x400000
+#define NR 16
+#define RATE (8 << 20)
+
+char buf[LEN];
+
+/* Path of our cgroup in the cpu controller, "/" if there is none. */
+static void own_group(char *path, size_t len) {
+	char line[512], *p;
+	FILE *f = fopen("/proc/self/cgroup", "r");
+
+	snprintf(path, len, "/");
+	if (f == NULL)
+		return;
+	while (fgets(line, sizeof line, f) != NULL) {
+		p = strchr(line, ':');
+		if (p == NULL || (strncmp(p, ":cpu,", 5) && strncmp(p, ":cpu:", 5) &&
+				!strstr(p, ",cpu,") && !strstr(p, ",cpu:")))
+			continue;
+		p = strchr(p + 1, ':');
+		if (p == NULL)
+			continue;
+		p[strcspn(p, "\n")] = 0;
+		snprintf(path, len, "%s", p + 1);
+		break;
+	}
+	fclose(f);
+}
+
+static int configure(const char *path, unsigned weight, unsigned long long rate) {
+	FILE *f = fopen(GROUPS, "w");
+	int res;
+
+	if (f == NULL) {
+		perror(GROUPS);
+		return -1;
+	}
+	fprintf(f, "%s %u %llu\n", path, weight, rate);
+	res = fclose(f);
+	if (res)
+		perror(GROUPS);
+	return res;
+}
+
+/* Returns MB/s of NR writes of LEN bytes. */
+static double run(int fd) {
+	struct timespec start, end;
+	double sec;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < NR; i++)
+		if (write(fd, buf, LEN) != LEN) {
+			perror("write");
+			return 0;
+		}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	sec = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+	return (double) NR * LEN / sec / (1 << 20);
+}
+
+int main() {
+	char path[256], line[512];
+	double free_rate, limited_rate;
+	FILE *f;
+	int fd, failed;
+
+	own_group(path, sizeof path);
+	printf("group %s\n", path);
+	fd = open("/dev/crc0", O_RDWR);
+	if (fd < 0) {
+		perror("open");
+		return 1;
+	}
+	gen(buf, sizeof buf);
+
+	free_rate = run(fd);
+	if (configure(path, 100, RATE))
+		return 1;
+	limited_rate = run(fd);
+	configure(path, 100, 0);
+	failed = limited_rate >= (RATE >> 20) * 1.2;
+	printf("unlimited %.1f MB/s, limited to %d MB/s: %.1f MB/s: %s\n",
+			free_rate, RATE >> 20, limited_rate, failed ? "FAILED" : "OK");
+
+	f = fopen(GROUPS, "r");
+	if (f != NULL) {
+		while (fgets(line, sizeof line, f) != NULL)
+			fputs(line, stdout);
+		fclose(f);
+	}
+	close(fd);
+	return failed;
+}
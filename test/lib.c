@@ -0,0 +1,57 @@
+#include "../libcrcdev/libcrcdev.h"
+#include "test.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define LEN 0x400000
+#define NR 256
+
+int main() {
+	struct crcdev_pool *pool = crcdev_pool_open(0);
+	if (pool == NULL) {
+		perror("crcdev_pool_open");
+		return 1;
+	}
+	char *buf = malloc(LEN);
+	gen(buf, LEN);
+	/* Whole buffer, split by the library. */
+	uint32_t sum = 0xffffffff;
+	if (crcdev_crc(pool, 0xedb88320, &sum, buf, LEN)) {
+		perror("crcdev_crc");
+		return 1;
+	}
+	/* Many small requests of different lengths, completed asynchronously. */
+	static struct crcdev_req reqs[NR];
+	struct crcdev_req *ptrs[NR], *done[NR];
+	int i, n, reaped = 0;
+	for (i = 0; i < NR; i++) {
+		reqs[i].buf = buf + i * 1000;
+		reqs[i].len = 1 + i * 37;
+		reqs[i].poly = i % 2 ? 0xedb88320 : 0x82f63b78;
+		reqs[i].sum = 0xffffffff;
+		reqs[i].user_data = &reqs[i];
+		ptrs[i] = &reqs[i];
+	}
+	crcdev_submit(pool, ptrs, NR);
+	while (reaped < NR) {
+		n = crcdev_wait(pool, done, NR, 1);
+		if (n < 0) {
+			fprintf(stderr, "crcdev_wait: %d\n", n);
+			return 1;
+		}
+		for (i = 0; i < n; i++) {
+			struct crcdev_req *req = done[i];
+			if (req->result || crcdev_verify(req->poly, 0xffffffff, req->buf,
+						req->len, req->sum)) {
+				fprintf(stderr, "bad result of request %d\n",
+						(int) (req - reqs));
+				return 1;
+			}
+		}
+		reaped += n;
+	}
+	crcdev_pool_close(pool);
+	sum ^= 0xffffffff;
+	printf("%08x\n", sum);
+	return 0;
+}
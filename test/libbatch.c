@@ -0,0 +1,100 @@
+#include "../libcrcdev/libcrcdev.h"
+#include "test.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Many small asynchronous requests through libcrcdev, with the driver's
+   trace on: the syscalls the library made on the devices (writes and
+   ioctls) are counted. Batched requests take two ioctls per batch, one by
+   one they would take SET_PARAMS, write and GET_RESULT each. Needs root,
+   debugfs mounted at /sys/kernel/debug and no other users of the devices. */
+
+#define TRACE_PARAM "/sys/module/crcdev/parameters/trace"
+#define TRACE "/sys/kernel/debug/crcdev/trace"
+#define LEN 0x100000
+#define NR 256
+
+static int set_trace(const char *value) {
+	int res, fd = open(TRACE_PARAM, O_WRONLY);
+
+	if (fd < 0) {
+		perror(TRACE_PARAM);
+		return -1;
+	}
+	res = write(fd, value, 1) == 1 ? 0 : -1;
+	close(fd);
+	return res;
+}
+
+/* Reads the recorded operations, returns number of writes and ioctls. */
+static long count_syscalls(int fd) {
+	struct crcdev_trace_rec recs[256];
+	long syscalls = 0;
+	ssize_t res;
+	int i;
+
+	while ((res = read(fd, recs, sizeof recs)) > 0)
+		for (i = 0; i < res / (ssize_t) sizeof recs[0]; i++)
+			syscalls += recs[i].op == CRCDEV_TRACE_WRITE ||
+				recs[i].op == CRCDEV_TRACE_IOCTL;
+	return syscalls;
+}
+
+int main() {
+	static struct crcdev_req reqs[NR];
+	struct crcdev_req *ptrs[NR], *done[NR];
+	struct crcdev_pool *pool;
+	long syscalls;
+	int i, n, trace_fd, reaped = 0, failed = 0;
+	char *buf = malloc(LEN);
+
+	gen(buf, LEN);
+	trace_fd = open(TRACE, O_RDONLY | O_NONBLOCK);
+	if (trace_fd < 0) {
+		perror(TRACE);
+		return 1;
+	}
+	if (set_trace("1"))
+		return 1;
+	/* Operations recorded before are not ours. */
+	count_syscalls(trace_fd);
+
+	pool = crcdev_pool_open(0);
+	if (pool == NULL || crcdev_pool_devices(pool) == 0) {
+		fprintf(stderr, "no devices\n");
+		set_trace("0");
+		return 1;
+	}
+	for (i = 0; i < NR; i++) {
+		reqs[i].buf = buf + i * 1000;
+		reqs[i].len = 1 + i * 37;
+		reqs[i].poly = i % 2 ? 0xedb88320 : 0x82f63b78;
+		reqs[i].sum = 0xffffffff;
+		ptrs[i] = &reqs[i];
+	}
+	crcdev_submit(pool, ptrs, NR);
+	while (reaped < NR) {
+		n = crcdev_wait(pool, done, NR, 1);
+		if (n < 0) {
+			fprintf(stderr, "crcdev_wait: %d\n", n);
+			failed = 1;
+			break;
+		}
+		for (i = 0; i < n; i++)
+			failed |= done[i]->result || crcdev_verify(done[i]->poly,
+					0xffffffff, done[i]->buf, done[i]->len, done[i]->sum);
+		reaped += n;
+	}
+	crcdev_pool_close(pool);
+
+	set_trace("0");
+	syscalls = count_syscalls(trace_fd);
+	close(trace_fd);
+	/* Buffers registered by the pool's descriptors add a few. */
+	failed |= syscalls * 4 > NR;
+	printf("%d requests, %ld syscalls (%d one by one): %s\n", NR, syscalls,
+			3 * NR, failed ? "FAILED" : "OK");
+	return failed;
+}
@@ -0,0 +1,67 @@
+#include "test.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <pthread.h>
+
+char buf[0x400000];
+int fd;
+volatile int done;
+
+void *tmain(void *arg) {
+	if (write(fd, buf, sizeof buf) != sizeof buf) {
+		perror("write");
+		return buf;
+	}
+	done = 1;
+	return 0;
+}
+
+int main() {
+	fd = open("/dev/crc0", O_RDWR);
+	if (fd < 0) {
+		perror("open");
+		return 1;
+	}
+	if (crcdev_ioctl_set_params(fd, 0xedb88320, 0xffffffff)) {
+		perror("set_params");
+		return 1;
+	}
+	gen(buf, sizeof buf);
+	pthread_t thr;
+	if (pthread_create(&thr, NULL, tmain, NULL)) {
+		perror("pthread_create");
+		return 1;
+	}
+	/* Progress must grow monotonically while the write is running. */
+	uint64_t last = 0;
+	while (!done) {
+		uint32_t sum;
+		uint64_t processed;
+		int active = crcdev_ioctl_get_progress(fd, &sum, &processed);
+		if (active < 0) {
+			perror("get_progress");
+			return 1;
+		}
+		if (active && processed < last) {
+			fprintf(stderr, "progress went back\n");
+			return 1;
+		}
+		if (active)
+			last = processed;
+		usleep(100);
+	}
+	void *res;
+	if (pthread_join(thr, &res) || res) {
+		fprintf(stderr, "writer failed\n");
+		return 1;
+	}
+	uint32_t sum;
+	if (crcdev_ioctl_get_result(fd, &sum)) {
+		perror("get_result");
+		return 1;
+	}
+	sum ^= 0xffffffff;
+	printf("%08x\n", sum);
+	return 0;
+}
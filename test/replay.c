@@ -0,0 +1,302 @@
+#include "test.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+
+/* Replays a trace recorded by the driver:
+
+	echo 1 > /sys/module/crcdev/parameters/trace
+	cat /sys/kernel/debug/crcdev/trace > trace.bin
+	./replay [-f] trace.bin
+
+   Every recorded file is replayed by its own thread, with the original
+   timing or, with -f, as fast as possible. Writing ioctls (WRITE_FIXED,
+   WRITE_STREAM) are replayed as writes of the same length, BLOCK_CRC and
+   BLOCK_VERIFY as BLOCK_CRC with 4 KiB blocks, ioctls other than
+   SET_PARAMS, GET_RESULT and GET_PROGRESS are skipped. Prints latency of
+   each kind of operation and throughput of writes. */
+
+enum { K_WRITE, K_SET_PARAMS, K_GET_RESULT, K_GET_PROGRESS, K_COUNT };
+static const char *kind_names[K_COUNT] = {
+	"write", "set_params", "get_result", "get_progress"
+};
+
+struct file_trace {
+	struct crcdev_trace_rec *recs;
+	int nr;
+	pthread_t thread;
+	/* Latency (ns) and kind of every replayed operation. */
+	uint64_t *lat;
+	int *kind;
+	int done;
+	uint64_t bytes;
+	int errors;
+};
+
+static int fast;
+static char *buf;
+static size_t buf_len;
+static uint64_t trace_start;
+static struct timespec replay_start;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Sleeps until the operation's time relative to the start. */
+static void wait_for(uint64_t time) {
+	uint64_t ns = time - trace_start;
+	struct timespec ts = replay_start;
+
+	ts.tv_sec += ns / 1000000000;
+	ts.tv_nsec += ns % 1000000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+static int open_dev(int minor) {
+	char path[32];
+	int fd;
+
+	snprintf(path, sizeof(path), "/dev/crc%d", minor);
+	fd = open(path, O_RDWR);
+	if (fd < 0)
+		perror(path);
+	return fd;
+}
+
+static int write_all(int fd, size_t len) {
+	ssize_t res;
+
+	while (len > 0) {
+		res = write(fd, buf, len);
+		if (res <= 0)
+			return -1;
+		len -= res;
+	}
+	return 0;
+}
+
+/* Block sums are replayed with 4 KiB blocks. */
+static int replay_blocks(int fd, size_t len) {
+	uint32_t *sums = malloc((len / 4096 + 1) * sizeof(uint32_t));
+	int res = crcdev_ioctl_block_crc(fd, buf, len, 4096, 0xedb88320,
+			0xffffffff, sums);
+	free(sums);
+	return res;
+}
+
+/* Returns kind of the replayed operation, -1 if it is not replayed. */
+static int replay_op(struct file_trace *ft, int *fd,
+		struct crcdev_trace_rec *rec) {
+	uint32_t sum;
+	uint64_t processed;
+	int res;
+
+	if (rec->op == CRCDEV_TRACE_OPEN || *fd < 0) {
+		/* Files opened before recording started are opened lazily. */
+		if (*fd < 0)
+			*fd = open_dev(rec->minor);
+		if (*fd < 0)
+			ft->errors++;
+		if (rec->op == CRCDEV_TRACE_OPEN || *fd < 0)
+			return -1;
+	}
+	switch (rec->op) {
+	case CRCDEV_TRACE_RELEASE:
+		close(*fd);
+		*fd = -1;
+		return -1;
+	case CRCDEV_TRACE_WRITE:
+		res = write_all(*fd, rec->size);
+		ft->bytes += rec->size;
+		break;
+	case CRCDEV_TRACE_IOCTL:
+		if (rec->cmd == _IOC_NR(CRCDEV_IOCTL_WRITE_FIXED) ||
+				rec->cmd == _IOC_NR(CRCDEV_IOCTL_WRITE_STREAM)) {
+			res = write_all(*fd, rec->size);
+			ft->bytes += rec->size;
+			break;
+		}
+		if (rec->cmd == _IOC_NR(CRCDEV_IOCTL_BLOCK_CRC) ||
+				rec->cmd == _IOC_NR(CRCDEV_IOCTL_BLOCK_VERIFY)) {
+			res = replay_blocks(*fd, rec->size);
+			ft->bytes += rec->size;
+			break;
+		}
+		if (rec->cmd == _IOC_NR(CRCDEV_IOCTL_SET_PARAMS)) {
+			res = crcdev_ioctl_set_params(*fd, 0xedb88320, 0xffffffff);
+			ft->errors += res != 0;
+			return K_SET_PARAMS;
+		}
+		if (rec->cmd == _IOC_NR(CRCDEV_IOCTL_GET_RESULT)) {
+			res = crcdev_ioctl_get_result(*fd, &sum);
+			ft->errors += res != 0;
+			return K_GET_RESULT;
+		}
+		if (rec->cmd == _IOC_NR(CRCDEV_IOCTL_GET_PROGRESS)) {
+			res = crcdev_ioctl_get_progress(*fd, &sum, &processed);
+			ft->errors += res != 0;
+			return K_GET_PROGRESS;
+		}
+		return -1;
+	default:
+		return -1;
+	}
+	ft->errors += res != 0;
+	return K_WRITE;
+}
+
+static void *replay_file(void *arg) {
+	struct file_trace *ft = arg;
+	uint64_t start;
+	int i, kind, fd = -1;
+
+	for (i = 0; i < ft->nr; i++) {
+		if (!fast)
+			wait_for(ft->recs[i].time);
+		start = now_ns();
+		kind = replay_op(ft, &fd, &ft->recs[i]);
+		if (kind < 0)
+			continue;
+		ft->lat[ft->done] = now_ns() - start;
+		ft->kind[ft->done++] = kind;
+	}
+	if (fd >= 0)
+		close(fd);
+	return NULL;
+}
+
+static int cmp_rec(const void *a, const void *b) {
+	const struct crcdev_trace_rec *x = a, *y = b;
+	if (x->file != y->file)
+		return x->file < y->file ? -1 : 1;
+	if (x->time != y->time)
+		return x->time < y->time ? -1 : 1;
+	return 0;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+static void report(struct file_trace *files, int nr_files, int nr_recs,
+		uint64_t elapsed) {
+	uint64_t *lat = malloc(nr_recs * sizeof(*lat));
+	uint64_t bytes = 0, total;
+	int errors = 0, f, i, k, n;
+
+	for (f = 0; f < nr_files; f++) {
+		bytes += files[f].bytes;
+		errors += files[f].errors;
+	}
+	printf("%d files, %d errors, %.3f s\n", nr_files, errors, elapsed / 1e9);
+	printf("%llu bytes written, %.1f MB/s\n", (unsigned long long) bytes,
+			bytes / (elapsed / 1e9) / 1e6);
+	printf("%-13s %8s %10s %10s %10s %10s\n", "op", "count", "avg us",
+			"p50 us", "p99 us", "max us");
+	for (k = 0; k < K_COUNT; k++) {
+		n = 0;
+		total = 0;
+		for (f = 0; f < nr_files; f++)
+			for (i = 0; i < files[f].done; i++)
+				if (files[f].kind[i] == k) {
+					lat[n++] = files[f].lat[i];
+					total += files[f].lat[i];
+				}
+		if (n == 0)
+			continue;
+		qsort(lat, n, sizeof(*lat), cmp_u64);
+		printf("%-13s %8d %10.1f %10.1f %10.1f %10.1f\n", kind_names[k], n,
+				total / 1e3 / n, lat[n / 2] / 1e3, lat[n * 99 / 100] / 1e3,
+				lat[n - 1] / 1e3);
+	}
+	free(lat);
+}
+
+int main(int argc, char **argv) {
+	struct crcdev_trace_rec *recs;
+	struct file_trace *files;
+	FILE *in;
+	long size;
+	int opt, nr_recs, nr_files, i, f;
+	uint64_t start;
+
+	while ((opt = getopt(argc, argv, "f")) != -1) {
+		if (opt != 'f') {
+			fprintf(stderr, "usage: %s [-f] trace\n", argv[0]);
+			return 1;
+		}
+		fast = 1;
+	}
+	if (optind >= argc) {
+		fprintf(stderr, "usage: %s [-f] trace\n", argv[0]);
+		return 1;
+	}
+	in = fopen(argv[optind], "rb");
+	if (in == NULL) {
+		perror(argv[optind]);
+		return 1;
+	}
+	fseek(in, 0, SEEK_END);
+	size = ftell(in);
+	rewind(in);
+	nr_recs = size / sizeof(*recs);
+	if (nr_recs == 0) {
+		fprintf(stderr, "empty trace\n");
+		return 1;
+	}
+	recs = malloc(nr_recs * sizeof(*recs));
+	if (fread(recs, sizeof(*recs), nr_recs, in) != nr_recs) {
+		perror("fread");
+		return 1;
+	}
+	fclose(in);
+
+	/* Group operations by file. */
+	trace_start = recs[0].time;
+	for (i = 0; i < nr_recs; i++) {
+		if (recs[i].time < trace_start)
+			trace_start = recs[i].time;
+		if (recs[i].size > buf_len)
+			buf_len = recs[i].size;
+	}
+	qsort(recs, nr_recs, sizeof(*recs), cmp_rec);
+	files = calloc(nr_recs, sizeof(*files));
+	nr_files = 0;
+	for (i = 0; i < nr_recs; i++) {
+		if (i == 0 || recs[i].file != recs[i - 1].file)
+			files[nr_files++].recs = &recs[i];
+		files[nr_files - 1].nr++;
+	}
+	for (f = 0; f < nr_files; f++) {
+		files[f].lat = malloc(files[f].nr * sizeof(uint64_t));
+		files[f].kind = malloc(files[f].nr * sizeof(int));
+	}
+	buf = malloc(buf_len + 1);
+	gen(buf, buf_len + 1);
+
+	clock_gettime(CLOCK_MONOTONIC, &replay_start);
+	start = now_ns();
+	for (f = 0; f < nr_files; f++)
+		if (pthread_create(&files[f].thread, NULL, replay_file, &files[f])) {
+			fprintf(stderr, "pthread_create failed\n");
+			return 1;
+		}
+	for (f = 0; f < nr_files; f++)
+		pthread_join(files[f].thread, NULL);
+	report(files, nr_files, nr_recs, now_ns() - start);
+	return 0;
+}
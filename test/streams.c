@@ -0,0 +1,61 @@
+#include "test.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+
+char buf[0x400000];
+
+#define NSTREAMS 8
+#define CHUNKSIZE 0x4000
+
+/* Like mux, but all streams share one file. Odd streams are written with
+   WRITE_STREAM, even ones with SELECT_STREAM and write. */
+int main() {
+	uint32_t id[NSTREAMS];
+	int i;
+	int fd = open("/dev/crc0", O_RDWR);
+	if (fd < 0) {
+		perror("open");
+		return 1;
+	}
+	for (i = 0; i < NSTREAMS; i++) {
+		if (crcdev_ioctl_create_stream(fd, 0xedb88320, 0xffffffff, &id[i])) {
+			perror("create_stream");
+			return 1;
+		}
+	}
+	gen(buf, sizeof buf);
+	int pos;
+	for (pos = 0; pos < sizeof buf; pos += CHUNKSIZE) {
+		for (i = 0; i < NSTREAMS; i++) {
+			int res;
+			if (i % 2) {
+				res = crcdev_ioctl_write_stream(fd, id[i], buf + pos, CHUNKSIZE);
+			} else {
+				if (crcdev_ioctl_select_stream(fd, id[i])) {
+					perror("select_stream");
+					return 1;
+				}
+				res = write(fd, buf + pos, CHUNKSIZE);
+			}
+			if (res != CHUNKSIZE) {
+				perror("write");
+				return 1;
+			}
+		}
+	}
+	for (i = 0; i < NSTREAMS; i++) {
+		uint32_t sum;
+		if (crcdev_ioctl_get_stream_result(fd, id[i], &sum)) {
+			perror("get_stream_result");
+			return 1;
+		}
+		if (crcdev_ioctl_destroy_stream(fd, id[i])) {
+			perror("destroy_stream");
+			return 1;
+		}
+		sum ^= 0xffffffff;
+		printf("%08x\n", sum);
+	}
+	return 0;
+}
@@ -1,6 +1,23 @@
 #include <stdint.h>
 #include <stddef.h>
+#include "crcdev_ioctl.h"
 
 int crcdev_ioctl_set_params(int fd, uint32_t poly, uint32_t sum);
 int crcdev_ioctl_get_result(int fd, uint32_t *sum);
+int crcdev_ioctl_get_progress(int fd, uint32_t *sum, uint64_t *processed);
+int crcdev_ioctl_register_buffer(int fd, void *buf, size_t len, uint32_t *id);
+int crcdev_ioctl_unregister_buffer(int fd, uint32_t id);
+int crcdev_ioctl_write_fixed(int fd, uint32_t id, uint64_t offset, uint64_t len);
+int crcdev_ioctl_submit(int fd, struct crcdev_ioctl_async_req *reqs, uint32_t nr);
+int crcdev_ioctl_reap(int fd, struct crcdev_ioctl_cqe *cqes, uint32_t nr, uint32_t min_complete);
+int crcdev_ioctl_create_stream(int fd, uint32_t poly, uint32_t sum, uint32_t *id);
+int crcdev_ioctl_select_stream(int fd, uint32_t id);
+int crcdev_ioctl_destroy_stream(int fd, uint32_t id);
+int crcdev_ioctl_write_stream(int fd, uint32_t id, const void *buf, uint64_t len);
+int crcdev_ioctl_get_stream_result(int fd, uint32_t id, uint32_t *sum);
+int crcdev_ioctl_clone_stream(int fd, uint32_t src, uint32_t *id);
+int crcdev_ioctl_block_crc(int fd, const void *buf, uint64_t len, uint32_t block_size, uint32_t poly, uint32_t sum, uint32_t *sums);
+int crcdev_ioctl_block_verify(int fd, const void *buf, uint64_t len, uint32_t block_size, uint32_t poly, uint32_t sum, const uint32_t *sums, uint8_t *bitmap);
+int crcdev_ioctl_get_usage(int fd, struct crcdev_ioctl_usage *usage);
 void gen(char *buf, size_t len);
+uint32_t cpu_crc(uint32_t poly, uint32_t sum, const char *buf, size_t len);
@@ -0,0 +1,53 @@
+#include "test.h"
+#include "libcrcdev/crcdev_user.h"
+#include <stdio.h>
+
+/* Userspace polled driver: the software model of the device, or a real one
+   bound to vfio-pci if its PCI address is given. Every request sums the
+   whole buffer and its sum is compared with the one computed on the CPU. */
+
+#define LEN 0x400000
+#define NR 16
+
+int main(int argc, char **argv) {
+	struct crcdev_udev *udev;
+	struct crcdev_dma dma;
+	struct crcdev_ureq reqs[NR], *done[NR];
+	unsigned long polls = 0;
+	uint32_t soft;
+	int i, n, left = NR, failed = 0;
+
+	udev = argc > 1 ? crcdev_udev_open_vfio(argv[1])
+		: crcdev_udev_open_model();
+	if (udev == NULL) {
+		fprintf(stderr, "can't open device\n");
+		return 1;
+	}
+	if (crcdev_udev_dma_alloc(udev, LEN, &dma)) {
+		fprintf(stderr, "can't allocate DMA memory\n");
+		return 1;
+	}
+	gen(dma.vaddr, LEN);
+	soft = cpu_crc(0xedb88320, 0xffffffff, dma.vaddr, LEN);
+	for (i = 0; i < NR; i++) {
+		reqs[i].iova = dma.iova;
+		reqs[i].len = LEN;
+		reqs[i].poly = 0xedb88320;
+		reqs[i].sum = 0xffffffff;
+		crcdev_udev_submit(udev, &reqs[i]);
+	}
+	while (left > 0) {
+		n = crcdev_udev_poll(udev, done, NR);
+		polls++;
+		for (i = 0; i < n; i++) {
+			printf("%08x: %s\n", done[i]->sum ^ 0xffffffff,
+					done[i]->sum == soft ? "OK" : "FAILED");
+			failed |= done[i]->sum != soft;
+		}
+		left -= n;
+	}
+	fprintf(stderr, "%lu polls\n", polls);
+	crcdev_udev_dma_free(udev, &dma);
+	crcdev_udev_close(udev);
+	return failed;
+}
@@ -0,0 +1,62 @@
+#include "test.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Writes through two files, one of them with a registered buffer, and
+   prints their usage. Usage of all processes is in debugfs
+   crcdev/clients. */
+
+#define LEN 0x400000
+#define NR 8
+
+char buf[LEN];
+
+static void print_usage(const char *name, int fd) {
+	struct crcdev_ioctl_usage u;
+
+	if (crcdev_ioctl_get_usage(fd, &u)) {
+		perror("get_usage");
+		exit(1);
+	}
+	printf("%s: %llu bytes in %llu transfers, device %.3f ms, waiting for "
+			"context %.3f ms, for device %.3f ms, copying %.3f ms, "
+			"%llu pinned, %llu memory\n", name,
+			(unsigned long long) u.bytes, (unsigned long long) u.transfers,
+			u.device_ns / 1e6, u.ctx_wait_ns / 1e6, u.queue_wait_ns / 1e6,
+			u.copy_ns / 1e6, (unsigned long long) u.pinned,
+			(unsigned long long) u.memory);
+}
+
+int main() {
+	uint32_t id;
+	int i;
+	int fd1 = open("/dev/crc0", O_RDWR);
+	int fd2 = open("/dev/crc0", O_RDWR);
+
+	if (fd1 < 0 || fd2 < 0) {
+		perror("open");
+		return 1;
+	}
+	gen(buf, sizeof buf);
+	if (crcdev_ioctl_register_buffer(fd2, buf, LEN, &id)) {
+		perror("register_buffer");
+		return 1;
+	}
+	for (i = 0; i < NR; i++) {
+		if (write(fd1, buf, LEN) != LEN) {
+			perror("write");
+			return 1;
+		}
+		if (crcdev_ioctl_write_fixed(fd2, id, 0, LEN)) {
+			perror("write_fixed");
+			return 1;
+		}
+	}
+	print_usage("write", fd1);
+	print_usage("write_fixed", fd2);
+	close(fd1);
+	close(fd2);
+	return 0;
+}
@@ -0,0 +1,167 @@
+#include "test.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+/* Opens files from two cgroups (of the cpu controller) with weights 100
+   and 300, keeps writing through all of them and compares device time of
+   the groups, which should be split by weight. Needs root, cgroup v1 cpu
+   controller and debugfs mounted at /sys/kernel/debug. */
+
+#define GROUPS "/sys/kernel/debug/crcdev/groups"
+#define THREADS 4
+#define LEN 0x100000
+#define SECONDS 5
+
+static const char *names[2] = { "/crcdev_weight_a", "/crcdev_weight_b" };
+static const unsigned weights[2] = { 100, 300 };
+
+char buf[LEN];
+volatile int stop;
+
+/* Mount point of the cpu controller, -1 if there is none. */
+static int cpu_mount(char *path, size_t len) {
+	char dev[256], dir[256], type[64], opts[256], *opt;
+	FILE *f = fopen("/proc/mounts", "r");
+	int res = -1;
+
+	if (f == NULL)
+		return -1;
+	while (res && fscanf(f, "%255s %255s %63s %255s %*d %*d", dev, dir, type,
+				opts) == 4) {
+		if (strcmp(type, "cgroup"))
+			continue;
+		for (opt = strtok(opts, ","); opt != NULL; opt = strtok(NULL, ","))
+			if (strcmp(opt, "cpu") == 0) {
+				snprintf(path, len, "%s", dir);
+				res = 0;
+			}
+	}
+	fclose(f);
+	return res;
+}
+
+static int write_file(const char *path, const char *line) {
+	FILE *f = fopen(path, "w");
+	int res;
+
+	if (f == NULL) {
+		perror(path);
+		return -1;
+	}
+	fputs(line, f);
+	res = fclose(f);
+	if (res)
+		perror(path);
+	return res;
+}
+
+/* Moves us to cgroup dir of the cpu controller mounted at mnt. */
+static int enter(const char *mnt, const char *dir) {
+	char path[512], pid[32];
+
+	snprintf(path, sizeof path, "%s%s/tasks", mnt, dir);
+	snprintf(pid, sizeof pid, "%d\n", (int) getpid());
+	return write_file(path, pid);
+}
+
+static int configure(const char *path, unsigned weight) {
+	char line[512];
+
+	snprintf(line, sizeof line, "%s %u 0\n", path, weight);
+	return write_file(GROUPS, line);
+}
+
+/* Device time of a group in us, -1 if it isn't listed. */
+static long long device_us(const char *path) {
+	char line[512], name[256];
+	unsigned long long rate, bytes, us;
+	unsigned weight;
+	long long res = -1;
+	FILE *f = fopen(GROUPS, "r");
+
+	if (f == NULL)
+		return -1;
+	while (fgets(line, sizeof line, f) != NULL)
+		if (sscanf(line, "%255s %u %llu %llu %llu", name, &weight, &rate,
+					&bytes, &us) == 5 && strcmp(name, path) == 0)
+			res = us;
+	fclose(f);
+	return res;
+}
+
+static void *writer(void *arg) {
+	int fd = *(int *) arg;
+
+	while (!stop)
+		if (write(fd, buf, LEN) != LEN) {
+			perror("write");
+			return (void *) 1;
+		}
+	return NULL;
+}
+
+int main() {
+	char mnt[256], dir[512];
+	pthread_t threads[2][THREADS];
+	int fds[2][THREADS];
+	long long us[2];
+	double ratio;
+	void *res;
+	int g, i, failed = 0;
+
+	if (cpu_mount(mnt, sizeof mnt)) {
+		fprintf(stderr, "no cpu cgroup controller\n");
+		return 1;
+	}
+	gen(buf, sizeof buf);
+
+	/* Files belong to the group of the task which opened them. */
+	for (g = 0; g < 2; g++) {
+		snprintf(dir, sizeof dir, "%s%s", mnt, names[g]);
+		mkdir(dir, 0755);
+		if (enter(mnt, names[g]) || configure(names[g], weights[g]))
+			return 1;
+		for (i = 0; i < THREADS; i++) {
+			fds[g][i] = open("/dev/crc0", O_RDWR);
+			if (fds[g][i] < 0) {
+				perror("open");
+				return 1;
+			}
+		}
+	}
+	if (enter(mnt, ""))
+		return 1;
+
+	for (g = 0; g < 2; g++)
+		us[g] = device_us(names[g]);
+	for (g = 0; g < 2; g++)
+		for (i = 0; i < THREADS; i++)
+			pthread_create(&threads[g][i], NULL, writer, &fds[g][i]);
+	sleep(SECONDS);
+	stop = 1;
+	for (g = 0; g < 2; g++)
+		for (i = 0; i < THREADS; i++) {
+			pthread_join(threads[g][i], &res);
+			failed |= res != NULL;
+			close(fds[g][i]);
+		}
+	for (g = 0; g < 2; g++)
+		us[g] = device_us(names[g]) - us[g];
+
+	ratio = us[0] > 0 ? (double) us[1] / us[0] : 0.0;
+	failed |= ratio < 2.0 || ratio > 4.5;
+	printf("weights %u:%u, device time %lld:%lld us, ratio %.2f: %s\n",
+			weights[0], weights[1], us[0], us[1], ratio,
+			failed ? "FAILED" : "OK");
+
+	for (g = 0; g < 2; g++) {
+		configure(names[g], 100);
+		snprintf(dir, sizeof dir, "%s%s", mnt, names[g]);
+		rmdir(dir);
+	}
+	return failed;
+}